@@ -0,0 +1,353 @@
+/***********************************************************************
+ * Host side check of RX instruction decoder                           *
+ *                                                                     *
+ * This source code is offered for use in the public domain. You may   *
+ * use, modify or distribute it freely.                                *
+ *                                                                     *
+ * This code is distributed in the hope that it will be useful but     *
+ * WITHOUT ANY WARRANTY. ALL WARRANTIES, EXPRESS OR IMPLIED ARE HEREBY *
+ * DISCLAIMED. This includes but is not limited to warranties of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                *
+ ***********************************************************************/
+
+/* decode-check write FILE     - put every first/second byte pair into FILE,
+                                 one per SAMPLE_SIZE bytes
+   decode-check golden         - read rx-elf-objdump listing of FILE from
+                                 stdin and print instruction lengths
+   decode-check check LENGTHS  - compare insn_decode with printed lengths
+   decode-check verify INSNS   - compare insn_decode with hand checked
+                                 encodings, see host/rx-insns.txt
+   decode-check bench          - measure insn_decode throughput, also in a
+                                 step loop with and without cache
+
+   Operand bytes of samples are zero and are followed by NOPs, so objdump
+   gets back in sync at the start of every sample. */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <rx-decode.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define OPCODE_NOP 0x03
+
+#define SAMPLES      0x10000
+#define SAMPLE_SIZE  16
+#define OPERAND_SIZE 8          /* Longest RX instruction */
+
+#ifndef BENCH_ROUNDS
+#define BENCH_ROUNDS 200
+#endif
+
+static void make_sample (unsigned char *dst, unsigned int n)
+{
+    memset(dst, 0, OPERAND_SIZE);
+    memset(dst + OPERAND_SIZE, OPCODE_NOP, SAMPLE_SIZE - OPERAND_SIZE);
+    dst[0] = (unsigned char)(n >> 8);
+    dst[1] = (unsigned char)n;
+}
+
+static int write_samples (const char *name)
+{
+    unsigned char sample[SAMPLE_SIZE];
+    unsigned int n;
+    FILE *f = fopen(name, "wb");
+    if (NULL == f)
+    {
+        perror(name);
+        return 1;
+    }
+    for (n = 0; n < SAMPLES; ++n)
+    {
+        make_sample(sample, n);
+        (void)fwrite(sample, 1, sizeof sample, f);
+    }
+    return (0 != fclose(f));
+}
+
+/* Lines of listing look like "   1230:\t75 60 00 \tint\t#0" */
+static int read_golden (void)
+{
+    static unsigned char lengths[SAMPLES];
+    char line[256];
+    unsigned int found = 0;
+    unsigned int n;
+    while (NULL != fgets(line, sizeof line, stdin))
+    {
+        char *p;
+        char *bytes;
+        char *text;
+        unsigned long address = strtoul(line, &p, 16);
+        unsigned int length = 0;
+        if (p == line ||
+            ':' != p[0] ||
+            '\t' != p[1] ||
+            0 != address % SAMPLE_SIZE ||
+            SAMPLES <= address / SAMPLE_SIZE)
+        {
+            continue;
+        }
+        bytes = p + 2;
+        text = strchr(bytes, '\t');
+        if (NULL == text)
+        {
+            continue;
+        }
+        for (p = bytes; p < text; ++p)
+        {
+            if (' ' != *p && (' ' == p[1] || '\t' == p[1]))
+            {
+                ++length;
+            }
+        }
+        /* Encodings objdump does not know */
+        ++text;
+        if ('.' == text[0] ||
+            '(' == text[0] ||
+            NULL != strstr(text, "unknown") ||
+            NULL != strstr(text, "bad"))
+        {
+            length = 0;
+        }
+        lengths[address / SAMPLE_SIZE] = (unsigned char)length;
+        ++found;
+    }
+    if (0 == found)
+    {
+        fprintf(stderr, "no instructions in listing\n");
+        return 1;
+    }
+    printf("# rx-elf-objdump lengths, line per first byte, column per second byte, 0 - invalid\n");
+    for (n = 0; n < SAMPLES; ++n)
+    {
+        putchar("0123456789abcdef"[lengths[n] & 0x0F]);
+        if (0xFF == (n & 0xFF))
+        {
+            putchar('\n');
+        }
+    }
+    return 0;
+}
+
+static int check (const char *name)
+{
+    unsigned char sample[SAMPLE_SIZE];
+    char line[512];
+    unsigned int n = 0;
+    unsigned int invalid = 0;
+    unsigned int mismatches = 0;
+    FILE *f = fopen(name, "r");
+    if (NULL == f)
+    {
+        perror(name);
+        return 1;
+    }
+    while (n < SAMPLES && NULL != fgets(line, sizeof line, f))
+    {
+        const char *p;
+        if ('#' == line[0])
+        {
+            continue;
+        }
+        for (p = line; n < SAMPLES && 0 != isxdigit((unsigned char)*p); ++p, ++n)
+        {
+            unsigned int expected = ('a' <= *p) ? (unsigned int)(*p - 'a' + 10) : (unsigned int)(*p - '0');
+            unsigned int length;
+            if (0 == expected)
+            {
+                ++invalid;
+                continue;
+            }
+            make_sample(sample, n);
+            (void)insn_decode(sample, &length);
+            if (length != expected)
+            {
+                printf("%02X %02X: decoder %u, objdump %u\n", sample[0], sample[1], length, expected);
+                ++mismatches;
+            }
+        }
+    }
+    (void)fclose(f);
+    if (SAMPLES != n)
+    {
+        fprintf(stderr, "%s: %u of %u lengths\n", name, n, SAMPLES);
+        return 1;
+    }
+    printf("%u pairs, %u invalid, %u mismatches\n", SAMPLES, invalid, mismatches);
+    return (0 != mismatches);
+}
+
+/* Names of flow kinds as in rx-opcodes.txt, in order of enum insn_kind */
+static const char * const kind_names[] =
+{
+    "next", "branch", "cond", "call", "return", "rte", "rtfi",
+    "jmp", "jsr", "bral", "bsrl", "int", "brk", "undefined"
+};
+
+/* Lines look like "75 01 05\t3\tnext\tcmp #5, r1" */
+static int verify (const char *name)
+{
+    char line[256];
+    unsigned int count = 0;
+    unsigned int mismatches = 0;
+    FILE *f = fopen(name, "r");
+    if (NULL == f)
+    {
+        perror(name);
+        return 1;
+    }
+    while (NULL != fgets(line, sizeof line, f))
+    {
+        unsigned char sample[SAMPLE_SIZE];
+        char *p = line;
+        char *kind_name;
+        char *text;
+        unsigned int size = 0;
+        unsigned int expected;
+        unsigned int length;
+        enum insn_kind kind;
+        if ('#' == line[0] ||
+            '\n' == line[0])
+        {
+            continue;
+        }
+        make_sample(sample, 0);
+        while (OPERAND_SIZE > size && 0 != isxdigit((unsigned char)*p))
+        {
+            sample[size++] = (unsigned char)strtoul(p, &p, 16);
+            while (' ' == *p)
+            {
+                ++p;
+            }
+        }
+        expected = (unsigned int)strtoul(p, &p, 10);
+        kind_name = strtok(p, "\t\n");
+        text = strtok(NULL, "\n");
+        if (0 == size ||
+            NULL == kind_name ||
+            NULL == text)
+        {
+            fprintf(stderr, "%s: bad line: %s", name, line);
+            (void)fclose(f);
+            return 1;
+        }
+        kind = insn_decode(sample, &length);
+        if (length != expected ||
+            0 != strcmp(kind_name, kind_names[kind]))
+        {
+            printf("%s: decoder %u %s, expected %u %s\n", text,
+                   length, kind_names[kind], expected, kind_name);
+            ++mismatches;
+        }
+        ++count;
+    }
+    (void)fclose(f);
+    printf("%u instructions, %u mismatches\n", count, mismatches);
+    return (0 != mismatches);
+}
+
+static double seconds (void)
+{
+    struct timespec t;
+    (void)clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+/* Step loop over body of foo() in test.c: NOP, SUB #1,R1, BNE.B */
+static void bench_loop (int cached)
+{
+    static const unsigned char loop[] = { 0x03, 0x60, 0x11, 0x21, 0xFD };
+    const unsigned long steps = (unsigned long)SAMPLES * BENCH_ROUNDS;
+    unsigned long total = 0;
+    unsigned long step;
+    unsigned int offset = 0;
+    unsigned int hits;
+    unsigned int misses;
+    double start;
+    double elapsed;
+    decode_cache_flush();
+    decode_cache_stats(&hits, &misses, 1);
+    start = seconds();
+    for (step = 0; step < steps; ++step)
+    {
+        unsigned int length;
+        total += cached ?
+            (unsigned long)insn_decode_cached(&loop[offset], &length) :
+            (unsigned long)insn_decode(&loop[offset], &length);
+        offset += length;
+        if (sizeof loop <= offset)
+        {
+            offset = 0;
+        }
+    }
+    elapsed = seconds() - start;
+    decode_cache_stats(&hits, &misses, 1);
+    printf("step loop %s: %.1f ns per instruction", cached ? "with cache" : "without cache",
+           elapsed * 1e9 / (double)steps);
+    if (cached)
+    {
+        printf(", %u hits, %u misses", hits, misses);
+    }
+    printf(" (checksum %lu)\n", total);
+}
+
+static int bench (void)
+{
+    static unsigned char samples[SAMPLES][SAMPLE_SIZE];
+    unsigned long total = 0;
+    unsigned int round;
+    unsigned int n;
+    double start;
+    double elapsed;
+    for (n = 0; n < SAMPLES; ++n)
+    {
+        make_sample(samples[n], n);
+    }
+    start = seconds();
+    for (round = 0; round < BENCH_ROUNDS; ++round)
+    {
+        for (n = 0; n < SAMPLES; ++n)
+        {
+            unsigned int length;
+            total += (unsigned long)insn_decode(samples[n], &length);
+            total += length;
+        }
+    }
+    elapsed = seconds() - start;
+    printf("%u decodes in %.3f s: %.1f ns per instruction, %.1f M/s (checksum %lu)\n",
+           SAMPLES * BENCH_ROUNDS, elapsed,
+           elapsed * 1e9 / ((double)SAMPLES * BENCH_ROUNDS),
+           (double)SAMPLES * BENCH_ROUNDS / elapsed * 1e-6, total);
+    bench_loop(0);
+    bench_loop(1);
+    return 0;
+}
+
+int main (int argc, char *argv[])
+{
+    if (3 == argc && 0 == strcmp(argv[1], "write"))
+    {
+        return write_samples(argv[2]);
+    }
+    if (2 == argc && 0 == strcmp(argv[1], "golden"))
+    {
+        return read_golden();
+    }
+    if (3 == argc && 0 == strcmp(argv[1], "check"))
+    {
+        return check(argv[2]);
+    }
+    if (3 == argc && 0 == strcmp(argv[1], "verify"))
+    {
+        return verify(argv[2]);
+    }
+    if (2 == argc && 0 == strcmp(argv[1], "bench"))
+    {
+        return bench();
+    }
+    fprintf(stderr, "usage: %s write FILE | golden | check LENGTHS | verify INSNS | bench\n", argv[0]);
+    return 2;
+}
@@ -0,0 +1,117 @@
+/***********************************************************************
+ * GDB stub for bare-metal Renesas RX target             .             *
+ *                                                                     *
+ * Created by Maxim Salov                                              *
+ *                                                                     *
+ * This source code is offered for use in the public domain. You may   *
+ * use, modify or distribute it freely.                                *
+ *                                                                     *
+ * This code is distributed in the hope that it will be useful but     *
+ * WITHOUT ANY WARRANTY. ALL WARRANTIES, EXPRESS OR IMPLIED ARE HEREBY *
+ * DISCLAIMED. This includes but is not limited to warranties of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.                *
+ ***********************************************************************/
+
+#include <rx-decode.h>
+#include <string.h>
+
+/* Length rules of instruction classes, see rx-opcodes.txt */
+enum insn_rule
+{
+    RULE_FIXED,                 /* Length is complete */
+    RULE_PREFIX,                /* Length is the table for second byte in insn_prefix_tables */
+    RULE_LI_B1                  /* Add length of immediate, li in bits 3..2 of second byte */
+};
+
+struct insn_class
+{
+    unsigned char length;
+    unsigned char rule;
+    unsigned char kind;
+};
+
+/* insn_table, insn_prefix_tables */
+#include <rx-opcodes.h>
+
+/* Decoded instructions, direct mapped by address. Step loops decode
+   the same instructions again and again */
+struct decode_entry
+{
+    const unsigned char *address;
+    unsigned char length;       /* 0 - entry is empty */
+    unsigned char kind;
+};
+
+static struct decode_entry decode_cache[DECODE_CACHE_SIZE];
+static unsigned int        decode_hits = 0;
+static unsigned int        decode_misses = 0;
+
+enum insn_kind insn_decode (const unsigned char *pc, /*@out@*/ unsigned int *length)
+{
+    const struct insn_class *insn = &insn_table[pc[0]];
+    if (RULE_PREFIX == insn->rule)
+    {
+        insn = &insn_prefix_tables[insn->length][pc[1]];
+    }
+    *length = insn->length;
+    if (RULE_LI_B1 == insn->rule)
+    {
+        unsigned int li = (pc[1] >> 2) & 0x03;
+        if (0 == li)
+        {
+            li = 4;
+        }
+        *length += li;
+    }
+    return (enum insn_kind)insn->kind;
+}
+
+enum insn_kind insn_decode_cached (const unsigned char *pc, /*@out@*/ unsigned int *length)
+{
+    struct decode_entry *entry = &decode_cache[(unsigned long)pc % DECODE_CACHE_SIZE];
+    enum insn_kind kind;
+    if (pc == entry->address &&
+        0 != entry->length)
+    {
+        ++decode_hits;
+        *length = entry->length;
+        return (enum insn_kind)entry->kind;
+    }
+    ++decode_misses;
+    kind = insn_decode(pc, length);
+    entry->address = pc;
+    entry->length = (unsigned char)*length;
+    entry->kind = (unsigned char)kind;
+    return kind;
+}
+
+void decode_cache_invalidate (const void *address, unsigned int length)
+{
+    const unsigned char * const start = (const unsigned char*)address;
+    unsigned int i;
+    for (i = 0; i < DECODE_CACHE_SIZE; ++i)
+    {
+        struct decode_entry *entry = &decode_cache[i];
+        if (start < entry->address + entry->length &&
+            entry->address < start + length)
+        {
+            entry->length = 0;
+        }
+    }
+}
+
+void decode_cache_flush (void)
+{
+    memset(decode_cache, 0, sizeof decode_cache);
+}
+
+void decode_cache_stats (/*@out@*/ unsigned int *hits, /*@out@*/ unsigned int *misses, int reset)
+{
+    *hits = decode_hits;
+    *misses = decode_misses;
+    if (reset)
+    {
+        decode_hits = 0;
+        decode_misses = 0;
+    }
+}
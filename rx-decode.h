@@ -0,0 +1,46 @@
+#ifndef RX_DECODE_H__
+#define RX_DECODE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Kinds of control flow of instruction classes */
+enum insn_kind
+{
+    INSN_NEXT,                  /* Falls through to next instruction */
+    INSN_BRANCH,                /* BRA with displacement */
+    INSN_COND,                  /* BCnd with displacement */
+    INSN_CALL,                  /* BSR with displacement */
+    INSN_RETURN,                /* RTS, RTSD */
+    INSN_RTE,
+    INSN_RTFI,
+    INSN_JMP,                   /* JMP Rs */
+    INSN_JSR,                   /* JSR Rs */
+    INSN_BRAL,                  /* BRA.L Rs */
+    INSN_BSRL,                  /* BSR.L Rs */
+    INSN_INT,
+    INSN_BRK,
+    INSN_UNDEFINED              /* Raises undefined instruction exception */
+};
+
+/* Classify instruction, length is 0 for undefined ones */
+enum insn_kind insn_decode (const unsigned char *pc, /*@out@*/ unsigned int *length);
+
+/* Number of entries in cache of decoded instructions */
+#ifndef DECODE_CACHE_SIZE
+#define DECODE_CACHE_SIZE 32
+#endif
+
+/* Classify instruction through the cache. Cached instructions must be
+   invalidated when memory under them is written */
+enum insn_kind insn_decode_cached (const unsigned char *pc, /*@out@*/ unsigned int *length);
+void decode_cache_invalidate (const void *address, unsigned int length);
+void decode_cache_flush (void);
+void decode_cache_stats (/*@out@*/ unsigned int *hits, /*@out@*/ unsigned int *misses, int reset);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* RX_DECODE_H__ */
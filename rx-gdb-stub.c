@@ -13,6 +13,7 @@
  ***********************************************************************/
 
 #include <rx-gdb-stub.h>
+#include <rx-decode.h>
 #include <intrinsics.h>
 #include <iodefine.h>
 #include <isr_vectors.h>
@@ -22,9 +23,17 @@
 
 static void stub_rsp_handler (unsigned int signal);
 static char stub_getchar (void);
+static int rx_available (void);
 static void stub_putchar (char c);
+static void tx_flush (void);
+static void tx_drain (void);
+static void stub_enter (void);
+static void stub_leave (void);
+static int set_baudrate (unsigned long baudrate);
 /*@unused@*/
 static void stub_puts (const char *str);
+static void agent_format (const char *format, const int64_t *args, unsigned int nargs, void (*put)(unsigned char));
+static void put_packet (const char *buffer);
 
 #define SIGBREAK '\x03'
 
@@ -58,6 +67,16 @@ extern unsigned int _stack;
 
 #define RAM_END ((void*)&_stack)
 
+/* Fixed vector table provided by linker script */
+/*@external@*/
+extern const unsigned int _fixed_vectors[];
+
+#define FIXED_VECTOR_UNDEFINED 3
+
+/* Relocatable vectors of stub, BRK shares vector 0 with INT #0 */
+#define VECTOR_BRK  0
+#define VECTOR_PUTS 1
+
 #define OPCODE_NOP 0x03
 #define OPCODE_BRK 0x00
 
@@ -67,11 +86,113 @@ static const char hexchars[] = "0123456789abcdef";
 
 static char trx_buffer[BUFFER_SIZE + 1];
 
+/* Set when GDB requests QStartNoAckMode: packets are not acknowledged */
+static unsigned char no_ack_mode = 0;
+
+/* Result of 'M' and 'X' data that is written by get_packet */
+static unsigned int  rx_stream_written = 0;
+static unsigned char rx_stream_ok = 0;
+static unsigned char rx_stream_accepted = 0;
+
 static unsigned char   stepping = 0;
 /*@null@*/
 static unsigned char * stepping_brk_address = NULL;
 static unsigned char   stepping_brk_opcode = OPCODE_BRK;
 
+/* Range stepping (vCont;r): stepping continues while PC is in [start, end) */
+static unsigned char range_stepping = 0;
+static unsigned int  range_start = 0;
+static unsigned int  range_end = 0;
+
+/* Step over calls ("monitor stepover on"): called function runs at full speed
+   till BRK at return address is reached with stack pointer of the caller */
+static unsigned char step_over_calls = 0;
+static unsigned int  call_return_pc = 0;
+static unsigned int  call_sp = 0;
+
+/* Step out ("monitor finish N"): next step runs till N return instructions
+   are executed, each of them must move stack pointer above its previous value */
+static unsigned int  finish_levels = 0;
+static unsigned int  finish_sp = 0;
+static unsigned char finishing = 0;
+static unsigned char finish_return = 0;
+
+/* Software breakpoints set by Z0 packets.
+   They are inserted in memory while target runs only */
+#ifndef MAX_BREAKPOINTS
+#define MAX_BREAKPOINTS 32
+#endif
+
+struct breakpoint
+{
+    unsigned char *address;
+    unsigned char opcode;               /* Original opcode, saved when inserted */
+    unsigned char inserted;
+    unsigned char conditions;           /* Number of condition expressions */
+    unsigned char commands;             /* Number of command expressions, they follow conditions */
+    unsigned int  agent_offset;         /* Expressions in agent_pool */
+    unsigned int  agent_size;
+};
+
+static struct breakpoint breakpoints[MAX_BREAKPOINTS];
+static unsigned int      breakpoints_count = 0;
+
+/* Agent expressions of breakpoints: each one is stored as
+   16-bit length followed by bytecode */
+#ifndef AGENT_POOL_SIZE
+#define AGENT_POOL_SIZE 512
+#endif
+
+#ifndef AGENT_STACK_SIZE
+#define AGENT_STACK_SIZE 32
+#endif
+
+static unsigned char agent_pool[AGENT_POOL_SIZE];
+static unsigned int  agent_pool_used = 0;
+static int64_t       agent_stack[AGENT_STACK_SIZE];
+
+/* Set when breakpoint at PC is stepped over before continue */
+static unsigned char stepping_over = 0;
+
+/* Write watchpoints set by Z2 packets. While any of them is set target is
+   single stepped and watched areas are compared with their copies after each step */
+#ifndef MAX_WATCHPOINTS
+#define MAX_WATCHPOINTS 4
+#endif
+
+#define WATCHPOINT_MAX_LENGTH 16
+
+struct watchpoint
+{
+    const volatile unsigned char *address;
+    unsigned int  length;
+    unsigned char value[WATCHPOINT_MAX_LENGTH];
+};
+
+static struct watchpoint watchpoints[MAX_WATCHPOINTS];
+static unsigned int      watchpoints_count = 0;
+
+/* Set when continue is performed by steps because of watchpoints */
+static unsigned char watching = 0;
+
+/* Displaced stepping: instruction at breakpoint is copied to RAM slot and
+   executed there followed by BRK, so breakpoints stay inserted in memory.
+   Branches, calls and RTS are emulated, slot holds NOP for them.
+   Interrupt may be accepted in the slot and its handler may stop at
+   breakpoint, so the step is pending until slot BRK or slot start is
+   reached again */
+#define DISPLACED_SLOT_SIZE 10
+
+static unsigned char displaced_slot[DISPLACED_SLOT_SIZE];
+static unsigned char displaced = 0;
+static unsigned char * displaced_brk = NULL;
+static unsigned int  displaced_pc = 0;
+static unsigned int  displaced_next_pc = 0;
+static unsigned int  displaced_sp = 0;
+
+/* Stop reason reported in T packet, e.g. "swbreak:;" */
+static char stop_reason[24] = "";
+
 __attribute__((naked))
 static void save_context (void)
 {
@@ -227,25 +348,60 @@ static void restore_context_and_exit (void)
         :: "i" (&registers), "i" (sizeof registers));
 }
 
-static unsigned int get_next_pc (void)
-/*@modifies nothing@*/
+/* Check condition of BCnd with the same encoding as BCnd 2 */
+static int branch_taken (unsigned int cnd)
 /*@globals registers@*/
 {
-    const unsigned char * const pc = (unsigned char*)registers[PC];
-    const unsigned char * next_pc = pc;
-    unsigned int opcode = *pc;
-    /* Parse first byte of instruction */
-    if (0x02 == opcode)                                /* 00000010  1   RTS  */
+    switch (cnd)
     {
-        unsigned int *sp = (unsigned int*)registers[R0];
-        next_pc = (unsigned char*)*sp;
+    case 0x00:                 /* BEQ, BZ */
+    case 0x01:                 /* BNE, BNZ */
+        return (0x00 == cnd) == PSW_Z;
+    case 0x02:                 /* BGEU, BC */
+    case 0x03:                 /* BLTU, BNC */
+        return (0x02 == cnd) == PSW_C;
+    case 0x04:                 /* BGTU */
+    case 0x05:                 /* BLEU */
+        return (0x04 == cnd) == (PSW_C && !PSW_Z);
+    case 0x06:                 /* BPZ */
+    case 0x07:                 /* BN */
+        return (0x07 == cnd) == PSW_S;
+    case 0x08:                 /* BGE */
+    case 0x09:                 /* BLT */
+        return (0x09 == cnd) == (PSW_S ^ PSW_O);
+    case 0x0A:                 /* BGT */
+    case 0x0B:                 /* BLE */
+        return (0x0B == cnd) == ((PSW_S ^ PSW_O) || PSW_Z);
+    case 0x0C:                 /* BO */
+    case 0x0D:                 /* BNO */
+        return (0x0C == cnd) == PSW_O;
+    case 0x0E:                 /* BRA 2 (00101110) */
+    case 0x0F:                 /* Reserved */
+    default:
+        return 0;
     }
-    else if (0x03 == opcode)                           /* 00000011  1   NOP */
+}
+
+/* Displacement of BRA, BCnd and BSR, its size follows from length */
+static int get_displacement (const unsigned char *pc, unsigned int length)
+{
+    switch (length)
     {
-        next_pc = pc + 1;
+    case 1:                     /* dsp:3 in the opcode, 0..2 mean 8..10 */
+    {
+        unsigned int dsp = pc[0] & 0x07;
+        if (dsp < 3)
+        {
+            dsp += 8;
+        }
+        return (int)dsp;
     }
-    else if (0x04 == opcode ||                         /* 00000100  4   BRA 4 */
-             0x05 == opcode)                           /* 00000101  4   BSR 2 */
+    case 2:
+        return (int)(signed char)pc[1];
+    case 3:
+        return (int)(short int)(((unsigned int)pc[1] << 0) |
+                                ((unsigned int)pc[2] << 8));
+    default:
     {
         unsigned int dsp = ((unsigned int)pc[1] << 0) |
             ((unsigned int)pc[2] << 8) |
@@ -254,507 +410,118 @@ static unsigned int get_next_pc (void)
         {
             dsp |= 0xFF000000U;
         }
-        next_pc = pc + (signed int)dsp;
-    }
-    else if (0x06 == opcode)                           /* 00000110 some kind of memory extended instruction
-                                                          00000110 xx0000xx 3+  SUB 2x
-                                                          00000110 xx0001xx 3+  CMP 4x
-                                                          00000110 xx0010xx 3+  ADD 2x
-                                                          00000110 xx0011xx 3+  MUL 3x
-                                                          00000110 xx0100xx 3+  AND 3x
-                                                          00000110 xx0101xx 3+  OR 3x
-                                                          00000110 101000xx 4+  SBB 2
-                                                          00000110 xx1000xx 4+  ADC 3
-                                                          00000110 xx1000xx 4+  DIV 2x
-                                                          00000110 xx1000xx 4+  DIVU 2x
-                                                          00000110 xx1000xx 4+  EMUL 2x
-                                                          00000110 xx1000xx 4+  EMULU 2x
-                                                          00000110 xx1000xx 4+  ITOF 1x
-                                                          00000110 xx1000xx 4+  MAX 2x
-                                                          00000110 xx1000xx 4+  MIN 2x
-                                                          00000110 xx1000xx 4+  TST 2x
-                                                          00000110 xx1000xx 4+  XCHG 1x
-                                                          00000110 xx1000xx 4+  XOR 2x
-                                                        */
-    {
-        unsigned int byte1 = pc[1];
-        unsigned int ld = byte1 & 0x03U;
-        if (3U == ld)
-        {
-            ld = 0;
-        }
-        if (0 != (byte1 & 0x20U))
-        {
-            ++ld;
-        }
-        next_pc = pc + 3 + ld;
-    }
-    else if ((0xF8 & opcode) == 0x08)                  /* 00001xxx  1   BRA 1 */
-    {
-        unsigned int dsp = opcode & 0x07;
-        if (dsp < 3)
-        {
-            dsp += 8;
-        }
-        next_pc = pc + dsp;
+        return (signed int)dsp;
     }
-    else if ((0xF0 & opcode) == 0x10)                  /* 0001xxxx  1   BCnd 1 */
-    {
-        /* Condition:
-           0: BEQ, BZ
-           1: BNE, BNZ */
-        unsigned int cnd = ((opcode & 0x80) != 0);
-        unsigned int dsp = 1;
-        if (cnd != PSW_Z)
-        {
-            dsp = opcode & 0x03;
-            if (dsp < 3)
-            {
-                dsp += 8;
-            }
-        }
-        next_pc = pc + dsp;
     }
-    else if (0x2E == opcode)                           /* 00101110  2   BRA 2 */
+}
+
+static unsigned int get_next_pc (void)
+/*@modifies nothing@*/
+/*@globals registers, _fixed_vectors@*/
+{
+    const unsigned char * const pc = (unsigned char*)registers[PC];
+    const unsigned int * const sp = (unsigned int*)registers[R0];
+    unsigned int length;
+    switch (insn_decode_cached(pc, &length))
     {
-        int dsp = (int)(signed char)pc[1];
-        next_pc = pc + dsp;
-    }
-    else if ((0xF0 & opcode) == 0x20)                  /* 0010xxxx  2   BCnd 2 */
+    case INSN_COND:
     {
-        unsigned int branch = 0;
-        unsigned int cnd = opcode & 0x0F;
-        switch (cnd)
-        {
-        case 0x00:                 /* BEQ, BZ */
-        case 0x01:                 /* BNE, BNZ */
-        {
-            if ((0 == cnd) == PSW_Z)
-            {
-                branch = 1;
-            }
-            break;
-        }
-        case 0x02:                 /* BGEU, BC */
-        case 0x03:                 /* BLTU, BNC */
-        {
-            if ((0x02 == cnd) == PSW_C)
-            {
-                branch = 1;
-            }
-            break;
-        }
-        case 0x04:                 /* BGTU */
-        case 0x05:                 /* BLEU */
-        {
-            unsigned int gtu = PSW_C && !PSW_Z;
-            if ((0x04 == cnd) == gtu)
-            {
-                branch = 1;
-            }
-            break;
-        }
-        case 0x06:                 /* BPZ */
-        case 0x07:                 /* BN */
-        {
-            if ((0x07 == cnd) == PSW_S)
-            {
-                branch = 1;
-            }
-            break;
-        }
-        case 0x08:                 /* BGE */
-        case 0x09:                 /* BLT */
+        /* BCnd 1 tests Z by bit 3, BCnd 3 by bit 0 */
+        unsigned int cnd = pc[0] & 0x0F;
+        if (1 == length)
         {
-            unsigned int lt = PSW_S ^ PSW_O;
-            if ((0x09 == cnd) == lt)
-            {
-                branch = 1;
-            }
-            break;
+            cnd = (pc[0] >> 3) & 0x01;
         }
-        case 0x0A:                /* BGT */
-        case 0x0B:                /* BLE */
+        else if (3 == length)
         {
-            unsigned int le = (PSW_S ^ PSW_O) || PSW_Z;
-            if ((0x0B == cnd) == le)
-            {
-                branch = 1;
-            }
-            break;
+            cnd = pc[0] & 0x01;
         }
-        case 0x0C:                /* BO */
-        case 0x0D:                /* BNO */
+        if (!branch_taken(cnd))
         {
-            if ((0x0C == cnd) == PSW_O)
-            {
-                branch = 1;
-            }
-            break;
-        }
-        case 0x0E:                /* BRA 2 (00101110) */
-        case 0x0F:                /* Reserved */
-        default:
-            /* Wrong opcode */
             break;
         }
+    }
+    /*@fallthrough@*/
+    case INSN_BRANCH:
+    case INSN_CALL:
+        return (unsigned int)(pc + get_displacement(pc, length));
+    case INSN_RETURN:
+        if (1 == length)                               /* RTS */
         {
-            int dsp = 2;
-            if (branch)
-            {
-                dsp = (int)(signed char)pc[1];
-            }
-            next_pc = pc + dsp;
+            return sp[0];
         }
-    }
-    else if (0x38 == opcode ||                         /* 00111000  3   BRA 3 */
-             0x39 == opcode)                           /* 00111001  3   BSR 1 */
+        return sp[pc[length - 1]];                     /* RTSD pops uimm words with PC on top */
+    case INSN_RTE:
     {
-        int dsp = (int)(short int)(((unsigned int)pc[1] << 0) |
-                                   ((unsigned int)pc[2] << 8));
-        next_pc = pc + dsp;
+        const unsigned int *isp = (unsigned int*)registers[ISP];
+        return isp[0];
     }
-    else if ((0xFE & opcode) == 0x3A)                  /* 0011101x  3   BCnd 3 */
-    {
-        /* Condition:
-           0: BEQ, BZ
-           1: BNE, BNZ */
-        unsigned int cnd = ((opcode & 0x01) != 0);
-        signed int dsp = 3;
-        if (cnd != PSW_Z)
+    case INSN_RTFI:
+        return registers[BPC];
+    case INSN_JMP:
+    case INSN_JSR:
+        return registers[pc[1] & 0x0F];
+    case INSN_BRAL:
+    case INSN_BSRL:
+        return (unsigned int)pc + registers[pc[1] & 0x0F];
+    case INSN_INT:
+        if (VECTOR_BRK != pc[2] &&
+            VECTOR_PUTS != pc[2])
         {
-            dsp = (int)(short int)(((unsigned int)pc[1] << 0) |
-                                   ((unsigned int)pc[2] << 8));
+            const unsigned int *intb = (unsigned int*)registers[INTB];
+            return intb[pc[2]];
         }
-        next_pc = pc + dsp;
+        /*@fallthrough@*/
+    case INSN_BRK:
+        /* Vectors of stub: BRK stops target right after the trap,
+           debug_puts returns there */
+        break;
+    case INSN_UNDEFINED:
+        return _fixed_vectors[FIXED_VECTOR_UNDEFINED];
+    case INSN_NEXT:
+    default:
+        break;
     }
-    else if (0x3F == opcode)                           /* 00111111  3   RTSD 2 */
-    {
-        unsigned int *sp = (unsigned int*)registers[R0];
-        unsigned int offset = pc[2];
-        next_pc = (unsigned char*)sp[offset];
-    }
-    else if ((0xFC & opcode) == 0x3C)                  /* 001111xx  3   MOV 4 */
-    {
-        next_pc = pc + 3;
-    }
-    else if ((0xE0 & opcode) == 0x40)                  /* 010xxxxx group of commands:
-                                                          010000xx  2+  SUB 2
-                                                          010001xx  2+  CMP 4
-                                                          010010xx  2+  ADD 2
-                                                          010011xx  2+  MUL 3
-                                                          010100xx  2+  AND 3
-                                                          010101xx  2+  OR 3
-                                                          01011xxx  2+  MOVU 2
-                                                       */
-    {
-        unsigned int ld = opcode & 0x03;
-        if (0x03 == ld)
-        {
-            ld = 0;
-        }
-        next_pc = pc + 2 + ld;
-    }
-    else if (0x67 == opcode)                           /* 01100111  2   RTSD 1 */
-    {
-        unsigned int *sp = (unsigned int*)registers[R0];
-        unsigned int offset = pc[1];
-        next_pc = (unsigned char*)sp[offset];
-    }
-    else if ((0xF0 & opcode) == 0x60)                  /* 0110xxxx group of commands:
-                                                          01100000  2   SUB 1
-                                                          01100001  2   CMP 1
-                                                          01100010  2   ADD 1
-                                                          01100011  2   MUL 1
-                                                          01100100  2   AND 1
-                                                          01100101  2   OR 1
-                                                          01100110  2   MOV 3
-                                                          01100111  2   RTSD 1 - already processed
-                                                          0110100x  2   SHLR 1
-                                                          0110101x  2   SHAR 1
-                                                          0110110x  2   SHLL 1
-                                                          01101110  2   PUSHM
-                                                          01101111  2   POPM
-                                                       */
-    {
-        next_pc = pc + 2;
-    }
-    else if (0x75 == opcode)                           /* 01110101  3   INT */
-    {
-        unsigned int *intb = (unsigned int*)registers[INTB];
-        unsigned int n = pc[2];
-        next_pc = (unsigned char*)intb[n];
-    }
-    else if ((0xF8 & opcode) == 0x70)                  /* 01110xxx group of commands:
-                                                          011100xx  3+  ADD 3
-                                                          01110101  3   CMP 2
-                                                          01110101  3   INT - already processed
-                                                          01110101  3   MOV 5
-                                                          01110101  3   MVTIPL
-                                                          011101xx  3+  AND 2
-                                                          011101xx  3+  CMP 3
-                                                          011101xx  3+  MUL 2
-                                                          011101xx  3+  OR 2
-                                                       */
-    {
-        unsigned int li = (opcode & 0x03);
-        if (0x03 == li)
-        {
-            li = 4;
-        }
-        next_pc = pc + 2 + li;
-    }
-    else if ((0xFC & opcode) == 0x78 ||                /* 011110xx
-                                                          0111100x  2   BSET 3
-                                                          0111101x  2   BCLR 3
-                                                       */
-             (0xFE & opcode) == 0x7C ||                /* 0111110x  2   BTST 3 */
-             0x7E == opcode)                           /* 01111110  2   ABS 1
-                                                          01111110  2   NEG 1
-                                                          01111110  2   NOT 1
-                                                          01111110  2   POP
-                                                          01111110  2   POPC
-                                                          01111110  2   PUSH 1
-                                                          01111110  2   PUSHC
-                                                          01111110  2   ROLC
-                                                          01111110  2   RORC
-                                                          01111110  2   SAT
-                                                       */
-    {
-        next_pc = pc + 2;
-    }
-    else if (0x7F == opcode)                           /* 01111111
-                                                          01111111 0000xxxx 2   JMP
-                                                          01111111 0001xxxx 2   JSR
-                                                          01111111 0101xxxx 2   BSR 3
-                                                          01111111 10000011 2   SCMPU
-                                                          01111111 100000xx 2   SUNTIL
-                                                          01111111 10000111 2   SMOVU
-                                                          01111111 100001xx 2   SWHILE
-                                                          01111111 10001011 2   SMOVB
-                                                          01111111 100010xx 2   SSTR
-                                                          01111111 10001111 2   SMOVF
-                                                          01111111 100011xx 2   RMPA
-                                                          01111111 10010011 2   SATR
-                                                          01111111 10010100 2   RTFI
-                                                          01111111 10010101 2   RTE
-                                                          01111111 10010110 2   WAIT
-                                                          01111111 1010xxxx 2   SETPSW
-                                                          01111111 1011xxxx 2   CLRPSW
-                                                       */
-    {
-        unsigned int byte1 = pc[1];
-        if ((0xE0 & byte1) == 0x00)                    /* 01111111 000xxxxx
-                                                          01111111 0000xxxx 2   JMP
-                                                          01111111 0001xxxx 2   JSR
-                                                       */
-        {
-            unsigned int rs = byte1 & 0x0F;
-            next_pc = (unsigned char*)registers[rs];
-        }
-        else if ((0xF0 & byte1) == 0x50)               /* 01111111 0101xxxx 2   BSR 3 */
-        {
-            unsigned int rs = byte1 & 0x0F;
-            next_pc = pc + (signed int)registers[rs];
-        }
-        else if (0x94  == byte1)                       /* 01111111 10010100 2   RTFI */
-        {
-            unsigned char *bpc = (unsigned char*)registers[BPC];
-            next_pc = bpc;
-        }
-        else if (0x95 ==  byte1)                       /* 01111111 10010101 2   RTE */
-        {
-            unsigned int *sp = (unsigned int*)registers[ISP];
-            next_pc = (unsigned char*)sp[0];
-        }
-        else                                           /* All other instructions from this group */
-        {
-            next_pc = pc + 2;
-        }
-    }
-    else if ((0xC0 & opcode) == 0x80)                  /* 10xxxxxx
-                                                          1011xxxx  2   MOVU 1
-                                                          10xx0xxx  2   MOV 1
-                                                          10xx1xxx  2   MOV 2
-                                                       */
-    {
-        next_pc = pc + 2;
-    }
-    else if (0xFC == opcode)                           /* 11111100
-                                                          11111100 00000011 3   SBB 1
-                                                          11111100 00000111 3   NEG 2
-                                                          11111100 00001011 3   ADC 2
-                                                          11111100 00001111 3   ABS 2
-                                                          11111100 00111011 3   NOT 2
-                                                          11111100 01100011 3   BSET 4
-                                                          11111100 01100111 3   BCLR 4
-                                                          11111100 01101011 3   BTST 4
-                                                          11111100 01101111 3   BNOT 4
-                                                          11111100 000100xx 3+  MAX 2
-                                                          11111100 000101xx 3+  MIN 2
-                                                          11111100 000110xx 3+  EMUL 2
-                                                          11111100 000111xx 3+  EMULU 2
-                                                          11111100 001000xx 3+  DIV 2
-                                                          11111100 001001xx 3+  DIVU 2
-                                                          11111100 001100xx 3+  TST 2
-                                                          11111100 001101xx 3+  XOR 2
-                                                          11111100 010000xx 3+  XCHG 1
-                                                          11111100 010001xx 3+  ITOF 1
-                                                          11111100 011000xx 3+  BSET 2
-                                                          11111100 011001xx 3+  BCLR 2
-                                                          11111100 011010xx 3+  BTST 2
-                                                          11111100 011011xx 3+  BNOT 2
-                                                          11111100 100000xx 3+  FSUB 2
-                                                          11111100 100001xx 3+  FCMP 2
-                                                          11111100 100010xx 3+  FADD 2
-                                                          11111100 100011xx 3+  FMUL 2
-                                                          11111100 100100xx 3+  FDIV 2
-                                                          11111100 100101xx 3+  FTOI
-                                                          11111100 100110xx 3+  ROUND
-                                                          11111100 1101xxxx 3+  SCCnd
-                                                          11111100 111xxxxx 3+  BMCnd 1
-                                                          11111100 111xxxxx 3+  BNOT 1
-                                                       */
-    {
-        unsigned int ld = pc[1] & 0x03;
-        if (3 == ld)
-        {
-            ld = 0;
-        }
-        next_pc = pc + 3 + ld;
-    }
-    else if (0xFD == opcode)                           /* 11111101 */
-    {
-        unsigned int byte1 = pc[1];
-        if (0x72 == byte1)                             /* 11111101 01110010 7   FADD 1
-                                                          11111101 01110010 7   FCMP 1
-                                                          11111101 01110010 7   FDIV 1
-                                                          11111101 01110010 7   FMUL 1
-                                                          11111101 01110010 7   FSUB 1
-                                                       */
-        {
-            next_pc = pc + 7;
-        }
-        else if ((0xF3 & byte1) == 0x70 ||             /* 11111101 0111xx00 4+  ADC 1
-                                                          11111101 0111xx00 4+  DIV 1
-                                                          11111101 0111xx00 4+  DIVU 1
-                                                          11111101 0111xx00 4+  EMUL 1
-                                                          11111101 0111xx00 4+  EMULU 1
-                                                          11111101 0111xx00 4+  MAX 1
-                                                          11111101 0111xx00 4+  MIN 1
-                                                          11111101 0111xx00 4+  STNZ
-                                                          11111101 0111xx00 4+  STZ
-                                                          11111101 0111xx00 4+  TST 1
-                                                          11111101 0111xx00 4+  XOR 1
-                                                       */
-                 (0xF3 & byte1) == 0x73)               /* 11111101 0111xx11 4+  MVTC 1 */
-        {
-            unsigned int li = byte1 & 0x03;
-            if (0 == li)
-            {
-                li = 4;
-            }
-            next_pc = pc + 3 + li;
-        }
-        else                                           /* 11111101 100xxxxx 3   SHLR 3
-                                                          11111101 101xxxxx 3   SHAR 3
-                                                          11111101 110xxxxx 3   SHLL 3
-                                                          11111101 111xxxxx 3   BMCnd 2
-                                                          11111101 111xxxxx 3   BNOT 3
-                                                          11111101 00000000 3   MULHI
-                                                          11111101 00000001 3   MULLO
-                                                          11111101 00000100 3   MACHI
-                                                          11111101 00000101 3   MACLO
-                                                          11111101 00010111 3   MVTACHI
-                                                          11111101 00010111 3   MVTACLO
-                                                          11111101 00011000 3   RACW
-                                                          11111101 00011111 3   MVFACHI
-                                                          11111101 00011111 3   MVFACMI
-                                                          11111101 0010xxxx 3   MOV 14
-                                                          11111101 0010xxxx 3   MOV 15
-                                                          11111101 0011xx0x 3   MOVU 4
-                                                          11111101 01100000 3   SHLR 2
-                                                          11111101 01100001 3   SHAR 2
-                                                          11111101 01100010 3   SHLL 2
-                                                          11111101 01100100 3   ROTR 2
-                                                          11111101 01100101 3   REVW
-                                                          11111101 01100110 3   ROTL 2
-                                                          11111101 01100111 3   REVL
-                                                          11111101 01101000 3   MVTC 2
-                                                          11111101 01101010 3   MVFC
-                                                          11111101 0110110x 3   ROTR 1
-                                                          11111101 0110111x 3   ROTL 1
-                                                       */
-        {
-            next_pc = pc + 3;
-        }
-    }
-    else if ((0xFE & opcode) == 0xFE)                  /* 1111111x
-                                                          11111110  3   MOV 10
-                                                          11111110  3   MOV 12
-                                                          11111110  3   MOVU 3
-                                                          11111111  3   ADD 4
-                                                          11111111  3   ADD 4
-                                                          11111111  3   MUL 4
-                                                          11111111  3   OR 4
-                                                          11111111  3   SUB 3
-                                                       */
-    {
-        next_pc = pc + 3;
-    }
-    else if ((0xF8 & opcode) == 0xF0)                  /* 11110xxx
-                                                          111100xx  2+  BCLR 1
-                                                          111100xx  2+  BSET 1
-                                                          111101xx  2+  BTST 1
-                                                          111101xx  2+  PUSH 2
-                                                       */
-    {
-        unsigned int ld = opcode & 0x03;
-        next_pc = pc + 2 + ld;
-    }
-    else if (0xFB == opcode)                           /* 11111011  3+  MOV 6 */
-    {
-        unsigned int li = (pc[1] >> 2) & 0x03;
-        if (0 == li)
-        {
-            li = 4;
-        }
-        next_pc = pc + 2 + li;
-    }
-    else if ((0xFE & opcode) == 0xF8)                  /* 111110xx  3+  MOV 8 */
-    {
-        unsigned int ld = opcode & 0x03;
-        unsigned int li = (pc[1] >> 2) & 0x03;
-        if (0 == li)
-        {
-            li = 4;
-        }
-        next_pc = pc + 2 + ld + li;
-    }
-    else if ((0xC0 & opcode) == 0xC0)                  /* 11xxxxxx
-                                                          11xx1111  2   MOV 7
-                                                          11xx11xx  2+  MOV 9
-                                                          11xxxx11  2+  MOV 11
-                                                          11xxxxxx  2+  MOV 13
-                                                        */
-    {
-        unsigned int lds = opcode & 0x03;
-        unsigned int ldd = (opcode >> 2) & 0x03;
-        if (3 == lds)
-        {
-            lds = 0;
-        }
-        if (3 == ldd)
-        {
-            ldd = 0;
-        }
-        next_pc = pc + 2 + lds + ldd;
-    }
-    else
+    return (unsigned int)(pc + length);
+}
+
+/* Kinds of control flow of instruction that matter for stepping */
+enum insn_flow
+{
+    FLOW_OTHER,
+    FLOW_BRANCH,
+    FLOW_CALL,
+    FLOW_RETURN,
+    FLOW_TRAP
+};
+
+/* Classify instruction at PC and report its length.
+   Targets of branches and returns are computed by get_next_pc */
+static enum insn_flow get_insn_flow (/*@out@*/ unsigned int *length)
+/*@globals registers@*/
+{
+    switch (insn_decode_cached((unsigned char*)registers[PC], length))
     {
-        /* Unknown opcode */
+    case INSN_CALL:
+    case INSN_JSR:
+    case INSN_BSRL:
+        return FLOW_CALL;
+    case INSN_RETURN:
+    case INSN_RTE:
+    case INSN_RTFI:
+        return FLOW_RETURN;
+    case INSN_BRANCH:
+    case INSN_COND:
+    case INSN_JMP:
+    case INSN_BRAL:
+        return FLOW_BRANCH;
+    case INSN_INT:
+    case INSN_BRK:
+    case INSN_UNDEFINED:
+        return FLOW_TRAP;
+    default:
+        return FLOW_OTHER;
     }
-    return (unsigned int)next_pc;
 }
 
 static unsigned int char2int (char c)
@@ -803,6 +570,26 @@ static unsigned int hex2int (const char *src, /*@null@*/ const char **p)
     return val;
 }
 
+static unsigned long dec2int (const char *src, /*@null@*/ const char **p)
+/*@globals nothing@*/
+/*@modifies *p@*/
+{
+    unsigned long val = 0U;
+    const char *s = src;
+    while ('0' <= *s &&
+           '9' >= *s)
+    {
+        val *= 10U;
+        val += (unsigned long)(*s - '0');
+        ++s;
+    }
+    if (NULL != p)
+    {
+        *p = s;
+    }
+    return val;
+}
+
 static void mem2hex_1 (char *dst, const void *src, size_t size)
 {
     size_t i;
@@ -926,25 +713,171 @@ static void hex2mem (/*@out@*/ void *dst, const char *src, size_t size)
     }
 }
 
-static void get_packet(void)
+static int is_ram_area (const void *address, unsigned int length)
+{
+    /* Area must not wrap around the end of address space */
+    return (unsigned int)address <= (unsigned int)address + length &&
+           RAM_END >= (const void*)((const char*)address + length);
+}
+
+/* Check if area does not overlap object of the stub */
+static int is_outside (const void *address, unsigned int length, const void *object, unsigned int size)
+{
+    return (unsigned int)address + length <= (unsigned int)object ||
+           (unsigned int)object + size <= (unsigned int)address;
+}
+
+/* Interrupt stack space used by the stub below ISP of the target */
+#ifndef STUB_STACK_SIZE
+#define STUB_STACK_SIZE 512
+#endif
+
+/* Check if area may be written by 'M' and 'X' packets. Their data is written
+   before checksum is verified, so a bit error in the header must not hit
+   buffers and stack that the stub uses while packet is received and handled */
+static int is_write_area (const void *address, unsigned int length)
+{
+    return is_ram_area(address, length) &&
+           is_outside(address, length, trx_buffer, sizeof trx_buffer) &&
+           is_outside(address, length, registers, sizeof registers) &&
+           is_outside(address, length, (const void*)(registers[ISP] - STUB_STACK_SIZE), STUB_STACK_SIZE);
+}
+
+/* CRC-32 as computed by GDB for qCRC: polynomial 0x04c11db7, MSB first,
+   no reflection and no final inversion. On-chip CRC calculator supports
+   only 8 and 16-bit polynomials, so it is computed by nibbles */
+static const uint32_t crc32_table[16] =
+{
+    0x00000000UL, 0x04c11db7UL, 0x09823b6eUL, 0x0d4326d9UL,
+    0x130476dcUL, 0x17c56b6bUL, 0x1a864db2UL, 0x1e475005UL,
+    0x2608edb8UL, 0x22c9f00fUL, 0x2f8ad6d6UL, 0x2b4bcb61UL,
+    0x350c9b64UL, 0x31cd86d3UL, 0x3c8ea00aUL, 0x384fbdbdUL
+};
+
+static uint32_t crc32 (const void *src, unsigned int length, uint32_t crc)
+{
+    const volatile uint8_t *s = src;
+    unsigned int i;
+    for (i = length; i; --i)
+    {
+        crc ^= (uint32_t)*s++ << 24;
+        crc = (crc << 4) ^ crc32_table[crc >> 28];
+        crc = (crc << 4) ^ crc32_table[crc >> 28];
+    }
+    return crc;
+}
+
+/* Find first occurrence of pattern in memory area.
+   Words that do not contain first byte of the pattern are skipped at once.
+   Returns 0 if pattern is not found, otherwise its address is in found
+   (RAM starts at address 0, so it is not returned as pointer) */
+static int memory_search (const void *start, unsigned int length, const char *pattern, unsigned int pattern_length,
+                          /*@out@*/ unsigned int *found)
+{
+    const volatile uint8_t *s = start;
+    const volatile uint8_t *last;
+    const uint8_t first = (uint8_t)pattern[0];
+    const uint32_t first_x4 = first * 0x01010101UL;
+    *found = 0;
+    if (0 == pattern_length ||
+        length < pattern_length)
+    {
+        return 0;
+    }
+    last = s + (length - pattern_length);
+    while (s <= last)
+    {
+        if (0 == ((uint32_t)s % 4) &&
+            3 <= (last - s))
+        {
+            /* Zero byte in the word means the first byte of the pattern is there */
+            uint32_t w = *(const volatile uint32_t*)s ^ first_x4;
+            if (0 == ((w - 0x01010101UL) & ~w & 0x80808080UL))
+            {
+                s += 4;
+                continue;
+            }
+        }
+        if (first == *s)
+        {
+            unsigned int i;
+            for (i = 1; i < pattern_length; ++i)
+            {
+                if ((uint8_t)pattern[i] != s[i])
+                {
+                    /*@innerbreak@*/
+                    break;
+                }
+            }
+            if (i == pattern_length)
+            {
+                *found = (unsigned int)s;
+                return 1;
+            }
+        }
+        ++s;
+    }
+    return 0;
+}
+
+/* Parse header of 'M' and 'X' packets: "addr,length:"
+   Returns pointer to packet data or NULL if header is malformed */
+/*@null@*/
+static const char * parse_write_header (const char *src, /*@out@*/ void **address, /*@out@*/ unsigned int *length)
+{
+    const char *p = src;
+    *address = (void*)hex2int(p, &p);
+    *length = 0;
+    if (',' != *p++)
+    {
+        return NULL;
+    }
+    *length = hex2int(p, &p);
+    if (':' != *p++)
+    {
+        return NULL;
+    }
+    return p;
+}
+
+static unsigned int get_packet(void)
 {
     char c = '\0';
+    unsigned int count;
     /* Retry until correct packet is received */
     for (;;)
     {
         unsigned int checksum = 0;
-        unsigned int count = 0;
         char *rxp = trx_buffer;
+        /* Data of 'M' and 'X' packets is not buffered,
+           it is written to destination memory as it arrives */
+        char streaming = '\0';
+        unsigned char *dst = NULL;
+        unsigned int remaining = 0;
+        unsigned int nibbles = 0;
+        unsigned int byte = 0;
+        unsigned char overflow = 0;
+        count = 0;
+        rx_stream_written = 0;
+        rx_stream_ok = 1;
+        rx_stream_accepted = 0;
 
         /* Wait for start byte */
         while ('$' != c)
         {
             c = stub_getchar();
+            /* GDB sends acknowledge on connect only,
+               so it is a new session that starts in normal mode */
+            if ('+' == c)
+            {
+                no_ack_mode = 0;
+            }
         }
 
         /* Receive packet payload */
         while (BUFFER_SIZE > count)
         {
+            char data;
             c = stub_getchar();
             if ('$' == c ||
                 '#' == c)
@@ -953,10 +886,77 @@ static void get_packet(void)
                 break;
             }
             checksum += c;
+            data = c;
+            /* Decode escaped character of binary data:
+               escape byte is followed by original byte xor 0x20 */
+            if ('}' == c)
+            {
+                c = stub_getchar();
+                checksum += c;
+                data = c ^ 0x20;
+            }
+            if ('\0' != streaming)
+            {
+                /* 'M' data is hex encoded, 'X' data is binary */
+                if ('X' == streaming)
+                {
+                    byte = (unsigned char)data;
+                    nibbles = 2;
+                }
+                else
+                {
+                    byte = (byte << 4) | (char2int(data) & 0x0F);
+                    ++nibbles;
+                }
+                if (2 == nibbles)
+                {
+                    /* Data that does not fit in requested length is only counted */
+                    if (0 != remaining)
+                    {
+                        *dst++ = (unsigned char)byte;
+                        --remaining;
+                    }
+                    ++rx_stream_written;
+                    nibbles = 0;
+                    byte = 0;
+                }
+                continue;
+            }
             count += 1;
-            *rxp++ = c;
+            *rxp++ = data;
+            if (':' == data &&
+                ('M' == trx_buffer[0] ||
+                 'X' == trx_buffer[0]))
+            {
+                void *address;
+                unsigned int length;
+                *rxp = '\0';
+                streaming = trx_buffer[0];
+                /* Data is written only if header is correct and destination area is RAM
+                   outside stub buffers, otherwise it is discarded and packet handler
+                   reports an error */
+                if (NULL != parse_write_header(trx_buffer + 1, &address, &length) &&
+                    is_write_area(address, length))
+                {
+                    dst = (unsigned char*)address;
+                    remaining = length;
+                    rx_stream_accepted = 1;
+                }
+            }
         }
         *rxp = '\0';
+        if (BUFFER_SIZE == count)
+        {
+            /* Skip the rest of packet that does not fit in buffer */
+            c = stub_getchar();
+            while ('$' != c &&
+                   '#' != c)
+            {
+                overflow = 1;
+                checksum += c;
+                c = stub_getchar();
+            }
+        }
         /* Receive and verify checksum */
         if ('#' == c)
         {
@@ -966,96 +966,1426 @@ static void get_packet(void)
             checksum &= 0x00FF;
             if (checksum == received_checksum)
             {
-                stub_putchar('+');
+                if (!no_ack_mode)
+                {
+                    stub_putchar('+');
+                }
+                if (overflow)
+                {
+                    /* Resending would not help: report error and wait for the next packet */
+                    put_packet("E01");
+                    continue;
+                }
                 break;
             }
-            else
+            else if (!no_ack_mode)
             {
+                /* GDB resends the packet, so memory that is modified by corrupted
+                   data will be overwritten with correct one. Corrupted header can
+                   not be undone: its area is written, but is_write_area keeps it
+                   out of stub buffers */
                 stub_putchar('-');
             }
+            else if ('\0' != streaming)
+            {
+                /* Memory is already modified and the packet will not be resent:
+                   pass it to the handler to report an error */
+                rx_stream_ok = 0;
+                break;
+            }
         }
     }
+    /* Return payload length, binary data may contain zero bytes */
+    return count;
 }
 
-static void put_packet (const char *buffer)
+static unsigned int tx_checksum = 0;
+
+#ifdef DEBUG_TIMING
+/* Transmission time of the last packet in CMT0 ticks (PCLK/512) and its size */
+static uint16_t     timing_start = 0;
+static unsigned int timing_ticks = 0;
+static unsigned int timing_bytes = 0;
+#endif /* DEBUG_TIMING */
+
+/* Run-length encoding state: character and number of its repetitions */
+static char         rle_char = '\0';
+static unsigned int rle_count = 0;
+
+/* Repeat count is sent as printable character (count + 29),
+   it must not be '#' or '$' and must not exceed '~' */
+#define RLE_MIN_REPEAT 3
+#define RLE_MAX_REPEAT ('~' - 29)
+
+static void packet_begin (void)
 {
-    do
-    {
-        const char *p = buffer;
-        unsigned int checksum = 0;
-        stub_putchar('$');
-        while ('\0' != *p)
-        {
-            stub_putchar(*p);
-            checksum += *p;
-            ++p;
-        }
-        stub_putchar('#');
-        stub_putchar(hexchars[(checksum >> 4) & 0x0F]);
-        stub_putchar(hexchars[(checksum >> 0) & 0x0F]);
-    }
-    while ('+' != stub_getchar());
+#ifdef DEBUG_TIMING
+    timing_start = CMT0.CMCNT;
+    timing_bytes = 0;
+#endif /* DEBUG_TIMING */
+    stub_putchar('$');
+    tx_checksum = 0;
+    rle_count = 0;
 }
 
-static void start_step (void)
+static void packet_emit (char c)
 {
-    stepping_brk_address = (unsigned char*)get_next_pc();
-    stepping_brk_opcode = *stepping_brk_address;
-    *stepping_brk_address = OPCODE_BRK;
-#ifdef DEBUG_STEPPING
-    char report[] = "stepi from xxxxxxxx to xxxxxxxx\n";
-    unsigned int v = registers[PC];
-    report[11] = hexchars[(v >> 28) & 0x0F];
-    report[12] = hexchars[(v >> 24) & 0x0F];
-    report[13] = hexchars[(v >> 20) & 0x0F];
-    report[14] = hexchars[(v >> 16) & 0x0F];
-    report[15] = hexchars[(v >> 12) & 0x0F];
-    report[16] = hexchars[(v >> 8) & 0x0F];
-    report[17] = hexchars[(v >> 4) & 0x0F];
-    report[18] = hexchars[(v >> 0) & 0x0F];
-    v = (unsigned int)stepping_brk_address;
-    report[23] = hexchars[(v >> 28) & 0x0F];
-    report[24] = hexchars[(v >> 24) & 0x0F];
-    report[25] = hexchars[(v >> 20) & 0x0F];
-    report[26] = hexchars[(v >> 16) & 0x0F];
-    report[27] = hexchars[(v >> 12) & 0x0F];
-    report[28] = hexchars[(v >> 8) & 0x0F];
-    report[29] = hexchars[(v >> 4) & 0x0F];
-    report[30] = hexchars[(v >> 0) & 0x0F];
-    trx_buffer[0] = 'O';
-    mem2hex(trx_buffer + 1, report, sizeof(report) - 1);
-    put_packet(trx_buffer);
-#endif /* DEBUG_STEPPING */
+    stub_putchar(c);
+    tx_checksum += c;
+#ifdef DEBUG_TIMING
+    ++timing_bytes;
+#endif /* DEBUG_TIMING */
 }
 
-static void finish_step (void)
+static void rle_flush (void)
 {
-    if (NULL != stepping_brk_address)
+    unsigned int repeat;
+    if (0 == rle_count)
     {
-        /* Step back on breakpoint instruction if it is hit */
-        if ((stepping_brk_address + 1) == (unsigned char*)registers[PC])
+        return;
+    }
+    packet_emit(rle_char);
+    repeat = rle_count - 1;
+    while (0 != repeat)
+    {
+        unsigned int n = repeat;
+        /* Short runs are sent as is */
+        if (RLE_MIN_REPEAT > n)
         {
-            --registers[PC];
+            packet_emit(rle_char);
+            --repeat;
+            continue;
         }
-        /* Clear breakpoint */
-        if (OPCODE_BRK != stepping_brk_opcode)
+        if (RLE_MAX_REPEAT < n)
         {
-            *stepping_brk_address = stepping_brk_opcode;
-            stepping_brk_address = NULL;
-            stepping_brk_opcode = OPCODE_BRK;
+            n = RLE_MAX_REPEAT;
+        }
+        while ('#' == (n + 29) ||
+               '$' == (n + 29))
+        {
+            --n;
+        }
+        packet_emit('*');
+        packet_emit((char)(n + 29));
+        repeat -= n;
+        /* Character before '*' is repeated, so it is sent again for the next run */
+        if (0 != repeat)
+        {
+            packet_emit(rle_char);
+            --repeat;
         }
     }
+    rle_count = 0;
 }
 
-static void prepare_state_report (void *dst, unsigned int signal)
+static void packet_putchar (char c)
 {
-    char *p = (char*)dst;
-    /* Report current state
-       Use extended reply format: report PC value */
-    *p++ = 'T';
-    *p++ = hexchars[(signal >> 4) & 0x0F];
-    *p++ = hexchars[(signal >> 0) & 0x0F];
-    /* Report PC register value */
+    if (0 != rle_count &&
+        rle_char == c)
+    {
+        ++rle_count;
+        return;
+    }
+    rle_flush();
+    rle_char = c;
+    rle_count = 1;
+}
+
+static void packet_putbyte (unsigned char c)
+{
+    /* Escape characters that have special meaning in binary data */
+    if ('#' == c ||
+        '$' == c ||
+        '}' == c ||
+        '*' == c)
+    {
+        packet_putchar('}');
+        c ^= 0x20;
+    }
+    packet_putchar(c);
+}
+
+static void packet_puthex (unsigned char c)
+{
+    packet_putchar(hexchars[(c >> 4) & 0x0F]);
+    packet_putchar(hexchars[(c >> 0) & 0x0F]);
+}
+
+static int packet_end (void)
+{
+    rle_flush();
+    stub_putchar('#');
+    stub_putchar(hexchars[(tx_checksum >> 4) & 0x0F]);
+    stub_putchar(hexchars[(tx_checksum >> 0) & 0x0F]);
+#ifdef DEBUG_TIMING
+    /* Measure time till the last byte is transmitted */
+    tx_drain();
+    timing_ticks = (uint16_t)(CMT0.CMCNT - timing_start);
+#endif /* DEBUG_TIMING */
+    if (no_ack_mode)
+    {
+        return 1;
+    }
+    /* Return nonzero if packet is acknowledged */
+    return '+' == stub_getchar();
+}
+
+static void packet_putmem (const void *src, size_t size, void (*put)(unsigned char))
+{
+    size_t i;
+    /* Use the widest possible access, like mem2hex does */
+    if (0 == ((uint32_t)src % 4)
+        && 0 == (size % 4))
+    {
+        const uint32_t *s = (const uint32_t*)src;
+        for (i = size / 4; i; --i)
+        {
+            uint32_t tmp = *s++;
+            const uint8_t *b = (const uint8_t*)&tmp;
+            put(b[0]);
+            put(b[1]);
+            put(b[2]);
+            put(b[3]);
+        }
+    }
+    else if (0 == ((uint32_t)src % 2)
+             && 0 == (size % 2))
+    {
+        const uint16_t *s = (const uint16_t*)src;
+        for (i = size / 2; i; --i)
+        {
+            uint16_t tmp = *s++;
+            const uint8_t *b = (const uint8_t*)&tmp;
+            put(b[0]);
+            put(b[1]);
+        }
+    }
+    else
+    {
+        const uint8_t *s = (const uint8_t*)src;
+        for (i = size; i; --i)
+        {
+            put(*s++);
+        }
+    }
+}
+
+static void put_packet (const char *buffer)
+{
+    do
+    {
+        const char *p = buffer;
+        packet_begin();
+        while ('\0' != *p)
+        {
+            packet_putchar(*p);
+            ++p;
+        }
+    }
+    while (!packet_end());
+}
+
+static void put_packet_hex (const void *src, size_t size)
+{
+    /* Data is encoded directly from memory while it is transmitted,
+       so reply size is not limited by buffer size */
+    do
+    {
+        packet_begin();
+        packet_putmem(src, size, packet_puthex);
+    }
+    while (!packet_end());
+}
+
+static void put_packet_binary (const void *src, size_t size)
+{
+    /* Binary data is read directly from memory while it is transmitted */
+    do
+    {
+        packet_begin();
+        packet_putchar('b');
+        packet_putmem(src, size, packet_putbyte);
+    }
+    while (!packet_end());
+}
+
+static void put_packet_output (const char *str)
+{
+    do
+    {
+        packet_begin();
+        packet_putchar('O');
+        packet_putmem(str, strlen(str), packet_puthex);
+    }
+    while (!packet_end());
+}
+
+#define MONITOR_COMMAND_SIZE 64
+
+/* Handle command that is sent by GDB 'monitor' command.
+   Reply is sent by the function, text output is sent in 'O' packets */
+static void monitor_command (const char *src)
+{
+    char command[MONITOR_COMMAND_SIZE + 1];
+    size_t length = strlen(src) / 2;
+    if (MONITOR_COMMAND_SIZE < length)
+    {
+        put_packet("E01");
+        return;
+    }
+    hex2mem(command, src, length);
+    command[length] = '\0';
+
+    if (0 == strncmp(command, "baud ", strlen("baud ")))
+    {
+        const char *p = command + strlen("baud ");
+        unsigned long baudrate = dec2int(p, &p);
+        if ('\0' != *p ||
+            0 == baudrate)
+        {
+            put_packet("E01");
+            return;
+        }
+        if (0 != set_baudrate(baudrate))
+        {
+            put_packet_output("Baudrate is not supported\n");
+            put_packet("E02");
+        }
+    }
+    else if (0 == strcmp(command, "stepover on") ||
+             0 == strcmp(command, "stepover off"))
+    {
+        step_over_calls = (0 == strcmp(command, "stepover on"));
+        put_packet("OK");
+    }
+    else if (0 == strncmp(command, "finish", strlen("finish")))
+    {
+        const char *p = command + strlen("finish");
+        unsigned long levels = 1;
+        if (' ' == *p)
+        {
+            levels = dec2int(p + 1, &p);
+        }
+        if ('\0' != *p ||
+            0 == levels)
+        {
+            put_packet("E01");
+            return;
+        }
+        /* Step out is performed by the next single step request,
+           other resume requests cancel it */
+        finish_levels = levels;
+        finish_sp = registers[R0];
+        put_packet("OK");
+    }
+    else if (0 == strcmp(command, "decode") ||
+             0 == strcmp(command, "decode reset"))
+    {
+        int64_t stats[3];
+        unsigned int hits;
+        unsigned int misses;
+        decode_cache_stats(&hits, &misses, 0 == strcmp(command, "decode reset"));
+        stats[0] = hits;
+        stats[1] = misses;
+        stats[2] = (0 == hits + misses) ? 0 : (int64_t)hits * 100 / (hits + misses);
+        do
+        {
+            packet_begin();
+            packet_putchar('O');
+            agent_format("Decode cache: %u hits, %u misses, %u%% hit rate\n", stats, 3, packet_puthex);
+        }
+        while (!packet_end());
+        put_packet("OK");
+    }
+    else
+    {
+        put_packet_output("Supported commands:\n"
+                          "  baud N - change SCI1 baudrate, GDB must reconnect at new rate\n"
+                          "  stepover on|off - step over BSR/JSR calls at full speed\n"
+                          "  finish [N] - next step returns from N functions (see rxfinish)\n"
+                          "  decode [reset] - show hit rate of decoded instruction cache\n");
+        put_packet("OK");
+    }
+}
+
+/* Address of step breakpoint */
+static unsigned int get_step_address (void)
+{
+    unsigned int length;
+    enum insn_flow flow;
+    finish_return = 0;
+    if (0 != call_return_pc)
+    {
+        /* Run till return from called function,
+           PC is at return address if called function is not returned yet */
+        if (!stepping_over &&
+            call_return_pc != registers[PC])
+        {
+            return call_return_pc;
+        }
+        return get_next_pc();
+    }
+    flow = get_insn_flow(&length);
+    finish_return = (FLOW_RETURN == flow);
+    if ((step_over_calls || finishing) &&
+        !stepping_over &&
+        FLOW_CALL == flow)
+    {
+        call_return_pc = registers[PC] + length;
+        call_sp = registers[R0];
+        return call_return_pc;
+    }
+    return get_next_pc();
+}
+
+static void start_step (void)
+{
+    stepping_brk_address = (unsigned char*)get_step_address();
+    stepping_brk_opcode = *stepping_brk_address;
+    *stepping_brk_address = OPCODE_BRK;
+#ifdef DEBUG_STEPPING
+    char report[] = "stepi from xxxxxxxx to xxxxxxxx\n";
+    unsigned int v = registers[PC];
+    report[11] = hexchars[(v >> 28) & 0x0F];
+    report[12] = hexchars[(v >> 24) & 0x0F];
+    report[13] = hexchars[(v >> 20) & 0x0F];
+    report[14] = hexchars[(v >> 16) & 0x0F];
+    report[15] = hexchars[(v >> 12) & 0x0F];
+    report[16] = hexchars[(v >> 8) & 0x0F];
+    report[17] = hexchars[(v >> 4) & 0x0F];
+    report[18] = hexchars[(v >> 0) & 0x0F];
+    v = (unsigned int)stepping_brk_address;
+    report[23] = hexchars[(v >> 28) & 0x0F];
+    report[24] = hexchars[(v >> 24) & 0x0F];
+    report[25] = hexchars[(v >> 20) & 0x0F];
+    report[26] = hexchars[(v >> 16) & 0x0F];
+    report[27] = hexchars[(v >> 12) & 0x0F];
+    report[28] = hexchars[(v >> 8) & 0x0F];
+    report[29] = hexchars[(v >> 4) & 0x0F];
+    report[30] = hexchars[(v >> 0) & 0x0F];
+    trx_buffer[0] = 'O';
+    mem2hex(trx_buffer + 1, report, sizeof(report) - 1);
+    put_packet(trx_buffer);
+#endif /* DEBUG_STEPPING */
+}
+
+/* Returns 1 if step breakpoint is hit */
+static int finish_step (void)
+{
+    int hit = 0;
+    if (NULL != stepping_brk_address)
+    {
+        /* Step back on breakpoint instruction if it is hit */
+        if ((stepping_brk_address + 1) == (unsigned char*)registers[PC])
+        {
+            --registers[PC];
+            hit = 1;
+        }
+        /* Clear breakpoint */
+        if (OPCODE_BRK != stepping_brk_opcode)
+        {
+            *stepping_brk_address = stepping_brk_opcode;
+            stepping_brk_address = NULL;
+            stepping_brk_opcode = OPCODE_BRK;
+        }
+    }
+    return hit;
+}
+
+/* Agent expression bytecodes, see "Agent Expressions" in GDB manual */
+enum agent_opcodes
+{
+    AX_ADD = 0x02, AX_SUB, AX_MUL, AX_DIV_SIGNED, AX_DIV_UNSIGNED,
+    AX_REM_SIGNED, AX_REM_UNSIGNED, AX_LSH, AX_RSH_SIGNED, AX_RSH_UNSIGNED,
+    AX_TRACE, AX_TRACE_QUICK, AX_LOG_NOT, AX_BIT_AND, AX_BIT_OR,
+    AX_BIT_XOR, AX_BIT_NOT, AX_EQUAL, AX_LESS_SIGNED, AX_LESS_UNSIGNED,
+    AX_EXT, AX_REF8, AX_REF16, AX_REF32, AX_REF64,
+    AX_IF_GOTO = 0x20, AX_GOTO, AX_CONST8, AX_CONST16, AX_CONST32,
+    AX_CONST64, AX_REG, AX_END, AX_DUP, AX_POP,
+    AX_ZERO_EXT, AX_SWAP, AX_GETV, AX_SETV, AX_TRACEV,
+    AX_TRACENZ, AX_TRACE16, AX_PICK = 0x32, AX_ROT, AX_PRINTF
+};
+
+/* Print unsigned number with padding, digits are formed in reverse order */
+static void agent_format_number (uint64_t value, unsigned int base, const char *digits, const char *prefix,
+                                 unsigned int width, char pad, unsigned char left, void (*put)(unsigned char))
+{
+    char buffer[24];
+    unsigned int n = 0;
+    unsigned int length;
+    do
+    {
+        buffer[n++] = digits[value % base];
+        value /= base;
+    }
+    while (0 != value);
+    length = n + strlen(prefix);
+    /* Sign and prefix precede zero padding */
+    if ('0' == pad)
+    {
+        for (; '\0' != *prefix; ++prefix)
+        {
+            put((unsigned char)*prefix);
+        }
+    }
+    for (; !left && width > length; --width)
+    {
+        put((unsigned char)pad);
+    }
+    for (; '\0' != *prefix; ++prefix)
+    {
+        put((unsigned char)*prefix);
+    }
+    while (n)
+    {
+        put((unsigned char)buffer[--n]);
+    }
+    for (; left && width > length; --width)
+    {
+        put(' ');
+    }
+}
+
+/* Format output of 'printf' instruction.
+   Supported conversions are d, i, u, x, X, o, c, s and p with flags '-' and '0',
+   field width and length modifiers */
+static void agent_format (const char *format, const int64_t *args, unsigned int nargs, void (*put)(unsigned char))
+{
+    const char *f = format;
+    unsigned int arg = 0;
+    while ('\0' != *f)
+    {
+        unsigned char left = 0;
+        unsigned char wide = 0;
+        char pad = ' ';
+        unsigned int width = 0;
+        unsigned int precision = UINT_MAX;
+        uint64_t value;
+        if ('%' != *f)
+        {
+            put((unsigned char)*f++);
+            continue;
+        }
+        ++f;
+        for (; '-' == *f || '0' == *f; ++f)
+        {
+            if ('-' == *f)
+            {
+                left = 1;
+            }
+            else
+            {
+                pad = '0';
+            }
+        }
+        while ('0' <= *f && '9' >= *f)
+        {
+            width = width * 10 + (unsigned int)(*f++ - '0');
+        }
+        if ('.' == *f)
+        {
+            precision = 0;
+            ++f;
+            while ('0' <= *f && '9' >= *f)
+            {
+                precision = precision * 10 + (unsigned int)(*f++ - '0');
+            }
+        }
+        while ('h' == *f || 'l' == *f || 'z' == *f || 'j' == *f || 't' == *f)
+        {
+            /* "ll" and "j" select 64-bit argument */
+            wide |= ('l' == f[0] && 'l' == f[1]) || 'j' == f[0];
+            ++f;
+        }
+        if ('%' == *f)
+        {
+            put((unsigned char)*f++);
+            continue;
+        }
+        if ('\0' == *f ||
+            nargs <= arg)
+        {
+            return;
+        }
+        value = (uint64_t)args[arg++];
+        if (left)
+        {
+            pad = ' ';
+        }
+        switch (*f++)
+        {
+        case 'd':
+        case 'i':
+        {
+            int64_t v = wide ? (int64_t)value : (int32_t)value;
+            agent_format_number((0 > v) ? (uint64_t)-v : (uint64_t)v, 10, hexchars,
+                                (0 > v) ? "-" : "", width, pad, left, put);
+            break;
+        }
+        case 'u':
+            agent_format_number(wide ? value : (uint32_t)value, 10, hexchars, "", width, pad, left, put);
+            break;
+        case 'o':
+            agent_format_number(wide ? value : (uint32_t)value, 8, hexchars, "", width, pad, left, put);
+            break;
+        case 'x':
+            agent_format_number(wide ? value : (uint32_t)value, 16, hexchars, "", width, pad, left, put);
+            break;
+        case 'X':
+            agent_format_number(wide ? value : (uint32_t)value, 16, "0123456789ABCDEF", "", width, pad, left, put);
+            break;
+        case 'p':
+            agent_format_number((uint32_t)value, 16, hexchars, "0x", width, pad, left, put);
+            break;
+        case 'c':
+            put((unsigned char)value);
+            break;
+        case 's':
+        {
+            /* String is read from target memory */
+            const volatile char *str = (const volatile char*)(uint32_t)value;
+            unsigned int length = 0;
+            while (precision > length &&
+                   '\0' != str[length])
+            {
+                ++length;
+            }
+            for (; !left && width > length; --width)
+            {
+                put(' ');
+            }
+            for (; length; --length, ++str)
+            {
+                put((unsigned char)*str);
+            }
+            for (; left && width > length; --width)
+            {
+                put(' ');
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+}
+
+/* Read big-endian operand of instruction */
+static uint32_t agent_operand (const unsigned char *code, unsigned int *pc, unsigned int size)
+{
+    uint32_t value = 0;
+    unsigned int i;
+    for (i = size; i; --i)
+    {
+        value = (value << 8) | code[(*pc)++];
+    }
+    return value;
+}
+
+/* Evaluate binary operation, returns 0 on success */
+static int agent_binary (unsigned int op, int64_t a, int64_t b, /*@out@*/ int64_t *result)
+{
+    switch (op)
+    {
+    case AX_ADD:
+        *result = (int64_t)((uint64_t)a + (uint64_t)b);
+        break;
+    case AX_SUB:
+        *result = (int64_t)((uint64_t)a - (uint64_t)b);
+        break;
+    case AX_MUL:
+        *result = (int64_t)((uint64_t)a * (uint64_t)b);
+        break;
+    case AX_DIV_SIGNED:
+    case AX_DIV_UNSIGNED:
+    case AX_REM_SIGNED:
+    case AX_REM_UNSIGNED:
+        if (0 == b)
+        {
+            *result = 0;
+            return 1;
+        }
+        if (AX_DIV_SIGNED == op)
+        {
+            *result = a / b;
+        }
+        else if (AX_DIV_UNSIGNED == op)
+        {
+            *result = (int64_t)((uint64_t)a / (uint64_t)b);
+        }
+        else if (AX_REM_SIGNED == op)
+        {
+            *result = a % b;
+        }
+        else
+        {
+            *result = (int64_t)((uint64_t)a % (uint64_t)b);
+        }
+        break;
+    case AX_LSH:
+    case AX_RSH_SIGNED:
+    case AX_RSH_UNSIGNED:
+        /* Shift by the width of operand or more is undefined in C:
+           all bits are shifted out, only sign fill is left */
+        if (64 <= (uint64_t)b)
+        {
+            *result = (AX_RSH_SIGNED == op && 0 > a) ? -1 : 0;
+        }
+        else if (AX_LSH == op)
+        {
+            *result = (int64_t)((uint64_t)a << b);
+        }
+        else if (AX_RSH_SIGNED == op)
+        {
+            *result = a >> b;
+        }
+        else
+        {
+            *result = (int64_t)((uint64_t)a >> b);
+        }
+        break;
+    case AX_BIT_AND:
+        *result = a & b;
+        break;
+    case AX_BIT_OR:
+        *result = a | b;
+        break;
+    case AX_BIT_XOR:
+        *result = a ^ b;
+        break;
+    case AX_EQUAL:
+        *result = (a == b);
+        break;
+    case AX_LESS_SIGNED:
+        *result = (a < b);
+        break;
+    case AX_LESS_UNSIGNED:
+        *result = ((uint64_t)a < (uint64_t)b);
+        break;
+    default:
+        *result = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/* Evaluate agent expression, returns 0 on success.
+   Result is the value on top of the stack at 'end' instruction */
+static int agent_eval (const unsigned char *code, unsigned int size, /*@out@*/ int64_t *result)
+{
+    /* Operand size of instructions with immediate operands */
+    static const unsigned char operands[] =
+    {
+        [AX_TRACE_QUICK] = 1, [AX_EXT] = 1, [AX_IF_GOTO] = 2, [AX_GOTO] = 2,
+        [AX_CONST8] = 1, [AX_CONST16] = 2, [AX_CONST32] = 4, [AX_CONST64] = 8,
+        [AX_REG] = 2, [AX_ZERO_EXT] = 1, [AX_GETV] = 2, [AX_SETV] = 2,
+        [AX_TRACEV] = 2, [AX_TRACE16] = 2, [AX_PICK] = 1, [AX_PRINTF] = 3
+    };
+    int64_t * const stack = agent_stack;
+    unsigned int sp = 0;
+    unsigned int pc = 0;
+    *result = 0;
+    while (pc < size)
+    {
+        unsigned int op = code[pc++];
+        unsigned int operand_size = (sizeof(operands) > op) ? operands[op] : 0;
+        uint32_t n = 0;
+        if (size - pc < operand_size)
+        {
+            return 1;
+        }
+        if (8 == operand_size)
+        {
+            n = agent_operand(code, &pc, 4);
+        }
+        else
+        {
+            n = agent_operand(code, &pc, operand_size);
+        }
+        /* Leave room for one more item */
+        if (AGENT_STACK_SIZE <= sp)
+        {
+            return 1;
+        }
+        switch (op)
+        {
+        case AX_ADD: case AX_SUB: case AX_MUL:
+        case AX_DIV_SIGNED: case AX_DIV_UNSIGNED:
+        case AX_REM_SIGNED: case AX_REM_UNSIGNED:
+        case AX_LSH: case AX_RSH_SIGNED: case AX_RSH_UNSIGNED:
+        case AX_BIT_AND: case AX_BIT_OR: case AX_BIT_XOR:
+        case AX_EQUAL: case AX_LESS_SIGNED: case AX_LESS_UNSIGNED:
+            if (2 > sp ||
+                0 != agent_binary(op, stack[sp - 2], stack[sp - 1], &stack[sp - 2]))
+            {
+                return 1;
+            }
+            --sp;
+            break;
+        case AX_LOG_NOT:
+        case AX_BIT_NOT:
+        case AX_EXT:
+        case AX_ZERO_EXT:
+        case AX_REF8:
+        case AX_REF16:
+        case AX_REF32:
+        case AX_REF64:
+        {
+            int64_t a;
+            if (1 > sp)
+            {
+                return 1;
+            }
+            a = stack[sp - 1];
+            if (AX_LOG_NOT == op)
+            {
+                a = !a;
+            }
+            else if (AX_BIT_NOT == op)
+            {
+                a = ~a;
+            }
+            else if (AX_EXT == op &&
+                     64 > n && 0 != n)
+            {
+                a = (int64_t)((uint64_t)a << (64 - n)) >> (64 - n);
+            }
+            else if (AX_ZERO_EXT == op &&
+                     64 > n)
+            {
+                a &= (int64_t)((1ULL << n) - 1);
+            }
+            else if (AX_REF8 == op)
+            {
+                a = *(const volatile uint8_t*)(uint32_t)a;
+            }
+            else if (AX_REF16 == op)
+            {
+                a = *(const volatile uint16_t*)(uint32_t)a;
+            }
+            else if (AX_REF32 == op)
+            {
+                a = *(const volatile uint32_t*)(uint32_t)a;
+            }
+            else if (AX_REF64 == op)
+            {
+                const volatile uint32_t *address = (const volatile uint32_t*)(uint32_t)a;
+                a = (int64_t)(((uint64_t)address[1] << 32) | address[0]);
+            }
+            stack[sp - 1] = a;
+            break;
+        }
+        case AX_IF_GOTO:
+            if (1 > sp)
+            {
+                return 1;
+            }
+            if (0 != stack[--sp])
+            {
+                pc = n;
+            }
+            break;
+        case AX_GOTO:
+            pc = n;
+            break;
+        case AX_CONST8:
+        case AX_CONST16:
+        case AX_CONST32:
+            stack[sp++] = n;
+            break;
+        case AX_CONST64:
+            stack[sp++] = (int64_t)(((uint64_t)n << 32) | agent_operand(code, &pc, 4));
+            break;
+        case AX_REG:
+            if (ACC == n)
+            {
+                stack[sp++] = (int64_t)(((uint64_t)registers[ACC + 1] << 32) | registers[ACC]);
+            }
+            else if (NUM_REGS > n)
+            {
+                stack[sp++] = registers[n];
+            }
+            else
+            {
+                return 1;
+            }
+            break;
+        case AX_END:
+            /* Commands leave nothing on the stack */
+            if (0 != sp)
+            {
+                *result = stack[sp - 1];
+            }
+            return 0;
+        case AX_DUP:
+            if (1 > sp)
+            {
+                return 1;
+            }
+            stack[sp] = stack[sp - 1];
+            ++sp;
+            break;
+        case AX_POP:
+            if (1 > sp)
+            {
+                return 1;
+            }
+            --sp;
+            break;
+        case AX_SWAP:
+        {
+            int64_t a;
+            if (2 > sp)
+            {
+                return 1;
+            }
+            a = stack[sp - 1];
+            stack[sp - 1] = stack[sp - 2];
+            stack[sp - 2] = a;
+            break;
+        }
+        case AX_PICK:
+            if (n + 1 > sp)
+            {
+                return 1;
+            }
+            stack[sp] = stack[sp - 1 - n];
+            ++sp;
+            break;
+        case AX_ROT:
+        {
+            /* a b c => c a b */
+            int64_t c;
+            if (3 > sp)
+            {
+                return 1;
+            }
+            c = stack[sp - 1];
+            stack[sp - 1] = stack[sp - 2];
+            stack[sp - 2] = stack[sp - 3];
+            stack[sp - 3] = c;
+            break;
+        }
+        /* Tracing is not supported, only stack effect is kept */
+        case AX_TRACE:
+        case AX_TRACENZ:
+            if (2 > sp)
+            {
+                return 1;
+            }
+            sp -= 2;
+            break;
+        case AX_TRACE_QUICK:
+        case AX_TRACE16:
+        case AX_TRACEV:
+            break;
+        case AX_PRINTF:
+        {
+            /* Operands: number of arguments (8 bits) and format length (16 bits).
+               Stack: arguments (first one is on top), channel and function */
+            const char *format = (const char*)&code[pc];
+            unsigned int nargs = n >> 16;
+            unsigned int length = n & 0xFFFF;
+            unsigned int i;
+            if (size - pc < length ||
+                0 == length ||
+                '\0' != format[length - 1] ||
+                nargs + 2 > sp)
+            {
+                return 1;
+            }
+            pc += length;
+            sp -= 2;
+            /* Reverse arguments to get them in order of format */
+            for (i = 0; i < nargs / 2; ++i)
+            {
+                int64_t a = stack[sp - 1 - i];
+                stack[sp - 1 - i] = stack[sp - nargs + i];
+                stack[sp - nargs + i] = a;
+            }
+            sp -= nargs;
+            do
+            {
+                packet_begin();
+                packet_putchar('O');
+                agent_format(format, &stack[sp], nargs, packet_puthex);
+            }
+            while (!packet_end());
+            break;
+        }
+        /* Trace state variables, floating point and unknown instructions */
+        default:
+            return 1;
+        }
+    }
+    /* Expression must end with 'end' instruction */
+    return 1;
+}
+
+/* Store agent expressions "Xlen,bytecode..." in pool.
+   Returns pointer to the rest of the packet or NULL on error */
+/*@null@*/
+static const char * agent_store (const char *src, /*@out@*/ unsigned char *count)
+{
+    const char *p = src;
+    *count = 0;
+    while ('X' == *p)
+    {
+        unsigned int i;
+        unsigned int size = hex2int(p + 1, &p);
+        if (',' != *p++ ||
+            0xFFFF < size ||
+            AGENT_POOL_SIZE - agent_pool_used < size + 2)
+        {
+            return NULL;
+        }
+        for (i = 0; i < size * 2; ++i)
+        {
+            if (UINT_MAX == char2int(p[i]))
+            {
+                return NULL;
+            }
+        }
+        agent_pool[agent_pool_used++] = (unsigned char)(size >> 8);
+        agent_pool[agent_pool_used++] = (unsigned char)size;
+        hex2mem_1(&agent_pool[agent_pool_used], p, size);
+        agent_pool_used += size;
+        p += size * 2;
+        ++*count;
+    }
+    return p;
+}
+
+/* Remove agent expressions of breakpoint from pool */
+static void agent_release (struct breakpoint *bp)
+{
+    unsigned int i;
+    memmove(&agent_pool[bp->agent_offset],
+            &agent_pool[bp->agent_offset + bp->agent_size],
+            agent_pool_used - bp->agent_offset - bp->agent_size);
+    agent_pool_used -= bp->agent_size;
+    for (i = 0; i < breakpoints_count; ++i)
+    {
+        if (breakpoints[i].agent_offset > bp->agent_offset)
+        {
+            breakpoints[i].agent_offset -= bp->agent_size;
+        }
+    }
+    bp->agent_offset = agent_pool_used;
+    bp->agent_size = 0;
+    bp->conditions = 0;
+    bp->commands = 0;
+}
+
+/* Check if breakpoint condition is true: any of expressions is not zero.
+   Evaluation errors are reported as stops */
+static int breakpoint_condition (const struct breakpoint *bp)
+{
+    const unsigned char *code = &agent_pool[bp->agent_offset];
+    unsigned int i;
+    if (0 == bp->conditions)
+    {
+        return 1;
+    }
+    for (i = 0; i < bp->conditions; ++i)
+    {
+        int64_t value;
+        unsigned int size = ((unsigned int)code[0] << 8) | code[1];
+        if (0 != agent_eval(code + 2, size, &value) ||
+            0 != value)
+        {
+            return 1;
+        }
+        code += size + 2;
+    }
+    return 0;
+}
+
+/* Run breakpoint commands, e.g. dprintf */
+static void breakpoint_commands (const struct breakpoint *bp)
+{
+    const unsigned char *code = &agent_pool[bp->agent_offset];
+    unsigned int i;
+    for (i = 0; i < bp->conditions + bp->commands; ++i)
+    {
+        int64_t value;
+        unsigned int size = ((unsigned int)code[0] << 8) | code[1];
+        if (i >= bp->conditions)
+        {
+            (void)agent_eval(code + 2, size, &value);
+        }
+        code += size + 2;
+    }
+}
+
+/*@null@*/
+static struct breakpoint * breakpoint_find (const void *address)
+{
+    unsigned int i;
+    for (i = 0; i < breakpoints_count; ++i)
+    {
+        if (address == breakpoints[i].address)
+        {
+            return &breakpoints[i];
+        }
+    }
+    return NULL;
+}
+
+/* Insert breakpoints in memory, except one at skip address */
+static void breakpoints_insert (/*@null@*/ const void *skip)
+{
+    unsigned int i;
+    for (i = 0; i < breakpoints_count; ++i)
+    {
+        struct breakpoint *bp = &breakpoints[i];
+        if (skip != bp->address)
+        {
+            bp->opcode = *bp->address;
+            *bp->address = OPCODE_BRK;
+            bp->inserted = 1;
+        }
+    }
+}
+
+static void breakpoints_remove (void)
+{
+    unsigned int i;
+    for (i = breakpoints_count; i; --i)
+    {
+        struct breakpoint *bp = &breakpoints[i - 1];
+        if (bp->inserted)
+        {
+            *bp->address = bp->opcode;
+            bp->inserted = 0;
+        }
+    }
+}
+
+static void breakpoint_delete (struct breakpoint *bp)
+{
+    agent_release(bp);
+    *bp = breakpoints[--breakpoints_count];
+}
+
+/* Handle Z0 and z0 packets: "addr,kind[;Xlen,cond...][;cmds:persist,Xlen,cmd...]" */
+static void breakpoint_command (char command, const char *src)
+{
+    const char *p = src;
+    unsigned char *address = (unsigned char*)hex2int(p, &p);
+    struct breakpoint *bp;
+    if (',' != *p++)
+    {
+        strcpy(trx_buffer, "E01");
+        return;
+    }
+    (void)hex2int(p, &p);
+    bp = breakpoint_find(address);
+    decode_cache_invalidate(address, 1);
+    if ('z' == command)
+    {
+        if (NULL != bp)
+        {
+            breakpoint_delete(bp);
+        }
+        strcpy(trx_buffer, "OK");
+        return;
+    }
+    if (!is_ram_area(address, 1))
+    {
+        strcpy(trx_buffer, "E02");
+        return;
+    }
+    if (NULL == bp)
+    {
+        if (MAX_BREAKPOINTS == breakpoints_count)
+        {
+            strcpy(trx_buffer, "E03");
+            return;
+        }
+        bp = &breakpoints[breakpoints_count++];
+        bp->address = address;
+        bp->inserted = 0;
+        bp->agent_offset = agent_pool_used;
+        bp->agent_size = 0;
+        bp->conditions = 0;
+        bp->commands = 0;
+    }
+    /* Conditions and commands are replaced by each Z0 packet */
+    agent_release(bp);
+    if (';' == p[0] &&
+        'X' == p[1])
+    {
+        p = agent_store(p + 1, &bp->conditions);
+    }
+    /* Commands are kept by stub only while GDB is connected,
+       so persistence flag is ignored */
+    if (NULL != p &&
+        0 == strncmp(p, ";cmds:", strlen(";cmds:")))
+    {
+        (void)hex2int(p + strlen(";cmds:"), &p);
+        p = (',' == *p) ? agent_store(p + 1, &bp->commands) : NULL;
+    }
+    bp->agent_size = agent_pool_used - bp->agent_offset;
+    if (NULL == p ||
+        '\0' != *p)
+    {
+        /* Breakpoint is not set if its expressions can not be stored */
+        breakpoint_delete(bp);
+        strcpy(trx_buffer, "E03");
+        return;
+    }
+    strcpy(trx_buffer, "OK");
+}
+
+/* Handle Z2 and z2 packets: "addr,length" */
+static void watchpoint_command (char command, const char *src)
+{
+    const char *p = src;
+    const unsigned char *address = (const unsigned char*)hex2int(p, &p);
+    unsigned int length;
+    unsigned int i;
+    if (',' != *p++)
+    {
+        strcpy(trx_buffer, "E01");
+        return;
+    }
+    length = hex2int(p, NULL);
+    for (i = 0; i < watchpoints_count; ++i)
+    {
+        if (address == watchpoints[i].address &&
+            length == watchpoints[i].length)
+        {
+            /*@innerbreak@*/
+            break;
+        }
+    }
+    if ('z' == command)
+    {
+        if (i < watchpoints_count)
+        {
+            watchpoints[i] = watchpoints[--watchpoints_count];
+        }
+        strcpy(trx_buffer, "OK");
+        return;
+    }
+    if (0 == length ||
+        WATCHPOINT_MAX_LENGTH < length)
+    {
+        strcpy(trx_buffer, "E02");
+        return;
+    }
+    if (i == watchpoints_count)
+    {
+        if (MAX_WATCHPOINTS == watchpoints_count)
+        {
+            strcpy(trx_buffer, "E03");
+            return;
+        }
+        watchpoints[i].address = address;
+        watchpoints[i].length = length;
+        ++watchpoints_count;
+    }
+    strcpy(trx_buffer, "OK");
+}
+
+/* Save values of watched areas */
+static void watchpoints_save (void)
+{
+    unsigned int i;
+    for (i = 0; i < watchpoints_count; ++i)
+    {
+        unsigned int j;
+        for (j = 0; j < watchpoints[i].length; ++j)
+        {
+            watchpoints[i].value[j] = watchpoints[i].address[j];
+        }
+    }
+}
+
+/* Find watchpoint which area is changed since last save */
+/*@null@*/
+static const struct watchpoint * watchpoint_triggered (void)
+{
+    unsigned int i;
+    for (i = 0; i < watchpoints_count; ++i)
+    {
+        unsigned int j;
+        for (j = 0; j < watchpoints[i].length; ++j)
+        {
+            if (watchpoints[i].value[j] != watchpoints[i].address[j])
+            {
+                return &watchpoints[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Prepare execution of instruction at PC in displaced slot.
+   Returns 0 if instruction must be stepped in place */
+static int displaced_step_prepare (void)
+{
+    const unsigned char * const pc = (unsigned char*)registers[PC];
+    unsigned int length;
+    enum insn_flow flow;
+    unsigned int next_pc;
+    if (displaced)
+    {
+        /* Slot is in use by step preempted by interrupt */
+        return 0;
+    }
+    flow = get_insn_flow(&length);
+    next_pc = get_next_pc();
+    displaced_sp = registers[R0];
+    if (FLOW_OTHER == flow)
+    {
+        /* MVFC PC depends on its address */
+        if (DISPLACED_SLOT_SIZE - 1 < length ||
+            (0xFD == pc[0] &&
+             0x6A == pc[1] &&
+             0x10 == (0xF0 & pc[2])))
+        {
+            return 0;
+        }
+        memcpy(displaced_slot, pc, length);
+        next_pc = (unsigned int)pc + length;
+    }
+    else if (FLOW_BRANCH == flow ||
+             (FLOW_CALL == flow &&
+              !step_over_calls &&
+              !finishing) ||
+             (FLOW_RETURN == flow &&
+              0x02 == pc[0]))
+    {
+        if (FLOW_CALL == flow)
+        {
+            registers[R0] -= 4;
+            *(unsigned int*)registers[R0] = (unsigned int)pc + length;
+        }
+        else if (FLOW_RETURN == flow)
+        {
+            registers[R0] += 4;
+        }
+        displaced_slot[0] = OPCODE_NOP;
+        length = 1;
+    }
+    else
+    {
+        /* Returns with register restore, exceptions and calls that are stepped over */
+        return 0;
+    }
+    displaced_slot[length] = OPCODE_BRK;
+    decode_cache_invalidate(displaced_slot, sizeof displaced_slot);
+    displaced = 1;
+    displaced_pc = registers[PC];
+    displaced_next_pc = next_pc;
+    displaced_brk = &displaced_slot[length];
+    finish_return = (FLOW_RETURN == flow);
+    stepping_brk_address = displaced_brk;
+    stepping_brk_opcode = OPCODE_BRK;
+    registers[PC] = (unsigned int)displaced_slot;
+    return 1;
+}
+
+/* Map PC from displaced slot back to program. PC elsewhere means that
+   the step is preempted by interrupt, it stays pending.
+   Returns 1 if slot BRK is executed but not as step breakpoint */
+static int displaced_step_finish (void)
+{
+    int executed = 0;
+    if ((displaced_brk + 1) == (unsigned char*)registers[PC])
+    {
+        --registers[PC];
+        executed = 1;
+    }
+    if (displaced_brk == (unsigned char*)registers[PC])
+    {
+        displaced = 0;
+        registers[PC] = displaced_next_pc;
+    }
+    else if ((unsigned int)displaced_slot == registers[PC])
+    {
+        /* Instruction is not executed, emulated stack operation is reverted */
+        displaced = 0;
+        registers[PC] = displaced_pc;
+        registers[R0] = displaced_sp;
+    }
+    return executed;
+}
+
+/* Resume target execution: breakpoint at PC is stepped over first.
+   Step breakpoint is also placed while called function is stepped over.
+   Continue is performed by steps while watchpoints are set */
+static void resume (unsigned char step)
+{
+    watchpoints_save();
+    if (!step)
+    {
+        /* Program may change its code while it runs, also when it runs by watch steps */
+        decode_cache_flush();
+        if (0 != watchpoints_count)
+        {
+            watching = 1;
+            step = 1;
+        }
+    }
+    if (NULL != breakpoint_find((void*)registers[PC]))
+    {
+        if (displaced_step_prepare())
+        {
+            breakpoints_insert(NULL);
+            stepping_over = !step;
+            stepping = 1;
+            return;
+        }
+        breakpoints_insert((void*)registers[PC]);
+        stepping_over = !step;
+        step = 1;
+    }
+    else
+    {
+        breakpoints_insert(NULL);
+    }
+    if (step ||
+        0 != call_return_pc)
+    {
+        stepping = 1;
+        start_step();
+    }
+}
+
+/* Step one instruction.
+   Returns 0 if the instruction is BRK: it is skipped and target is not resumed */
+static int step_instruction (void)
+{
+    if (0 != finish_levels)
+    {
+        /* Step out is armed by monitor command */
+        finishing = 1;
+        range_stepping = 0;
+    }
+    if (OPCODE_BRK == *(unsigned char*)registers[PC])
+    {
+        ++registers[PC];
+        stop_reason[0] = '\0';
+        finishing = 0;
+        finish_levels = 0;
+        return 0;
+    }
+    resume(1);
+    return 1;
+}
+
+static void prepare_state_report (void *dst, unsigned int signal)
+{
+    char *p = (char*)dst;
+    /* Report current state
+       Use extended reply format: report PC value */
+    *p++ = 'T';
+    *p++ = hexchars[(signal >> 4) & 0x0F];
+    *p++ = hexchars[(signal >> 0) & 0x0F];
+    /* Report PC register value */
     *p++ = hexchars[(PC >> 4) & 0x0F];
     *p++ = hexchars[(PC >> 0) & 0x0F];
     *p++ = ':';
@@ -1069,15 +2399,255 @@ static void prepare_state_report (void *dst, unsigned int signal)
     mem2hex(p, &registers[PSW], sizeof registers[0]);
     p += sizeof(registers[0]) * 2;
     *p++ = ';';
-    *p = '\0';
+    strcpy(p, stop_reason);
+}
+
+/* Target has the only thread, GDB refers to it as 1, 0 (any) or -1 (all) */
+#define STUB_THREAD_ID 1
+
+/* Check if thread-id of vCont action ("[pPID.]TID") refers to stub thread */
+static int vcont_thread_match (const char *src)
+{
+    const char *p = src;
+    if ('p' == *p)
+    {
+        p = strchr(p, '.');
+        if (NULL == p)
+        {
+            /* Whole process */
+            return 1;
+        }
+        ++p;
+    }
+    if ('-' == p[0] &&
+        '1' == p[1])
+    {
+        return 1;
+    }
+    return (0 == hex2int(p, NULL) ||
+            STUB_THREAD_ID == hex2int(p, NULL));
+}
+
+/* Handle vCont packet: "action[:thread-id][;action...]".
+   The leftmost action that applies to stub thread is performed.
+   Returns 1 if target is resumed, otherwise reply is in trx_buffer */
+static int vcont_command (const char *src)
+{
+    const char *p = src;
+    range_stepping = 0;
+    for (;;)
+    {
+        const char *thread = p;
+        while ('\0' != *thread &&
+               ':' != *thread &&
+               ';' != *thread)
+        {
+            ++thread;
+        }
+        if (':' != *thread ||
+            vcont_thread_match(thread + 1))
+        {
+            /*@innerbreak@*/
+            break;
+        }
+        p = strchr(thread, ';');
+        if (NULL == p)
+        {
+            /* No action for stub thread */
+            strcpy(trx_buffer, "E01");
+            return 0;
+        }
+        ++p;
+    }
+    switch (*p++)
+    {
+    case 'c':
+    case 'C':
+        /* Signals can not be delivered to bare-metal target */
+        finish_levels = 0;
+        resume(0);
+        return 1;
+    case 'r':
+        /* Step out armed by monitor command is for single step only */
+        finish_levels = 0;
+        range_start = hex2int(p, &p);
+        if (',' != *p++)
+        {
+            strcpy(trx_buffer, "E01");
+            return 0;
+        }
+        range_end = hex2int(p, &p);
+        range_stepping = 1;
+        /*@fallthrough@*/
+    case 's':
+    case 'S':
+        if (step_instruction())
+        {
+            return 1;
+        }
+        range_stepping = 0;
+        prepare_state_report(trx_buffer, TARGET_SIGNAL_TRAP);
+        return 0;
+    case 't':
+        /* Target is already stopped */
+        stop_reason[0] = '\0';
+        prepare_state_report(trx_buffer, 0);
+        return 0;
+    default:
+        strcpy(trx_buffer, "E01");
+        return 0;
+    }
 }
 
 static void stub_rsp_handler (unsigned int signal)
 {
+    unsigned char breakpoint_hit = 0;
+    int step_hit = 0;
+    int displaced_hit = 0;
+    const struct watchpoint *watch_hit = NULL;
+
     if (stepping)
     {
         stepping = 0;
-        finish_step();
+        step_hit = finish_step();
+    }
+    if (displaced)
+    {
+        displaced_hit = displaced_step_finish();
+    }
+    if (step_hit)
+    {
+        /* Internal steps may end at breakpoint */
+        breakpoint_hit = (stepping_over || range_stepping || finishing || watching ||
+                          0 != call_return_pc) &&
+                         NULL != breakpoint_find((void*)registers[PC]);
+    }
+    else if (displaced_hit)
+    {
+        /* Handler of interrupt accepted in the slot is returned and the step
+           is completed: its stop is already reported, target continues */
+        stepping_over = 1;
+    }
+    else if (TARGET_SIGNAL_TRAP == signal &&
+             NULL != breakpoint_find((void*)(registers[PC] - 1)))
+    {
+        /* Breakpoint is hit: PC points to the next byte after BRK */
+        --registers[PC];
+        breakpoint_hit = 1;
+    }
+    breakpoints_remove();
+
+    if (TARGET_SIGNAL_TRAP == signal)
+    {
+        /* Stops of internal steps are not reported */
+        unsigned char silent = stepping_over || range_stepping || finishing || watching ||
+                               0 != call_return_pc;
+        if (!step_hit &&
+            !displaced_hit &&
+            !breakpoint_hit &&
+            OPCODE_BRK == *(unsigned char*)(registers[PC] - 1))
+        {
+            /* BRK of the program is executed by internal step (e.g. while watching)
+               before step breakpoint is reached: it stops target like stepi over BRK */
+            silent = 0;
+        }
+        if (breakpoint_hit)
+        {
+            const struct breakpoint *bp = breakpoint_find((void*)registers[PC]);
+            if (!breakpoint_condition(bp))
+            {
+                /* Condition is false: step over breakpoint and continue */
+                breakpoint_hit = 0;
+            }
+            else if (0 != bp->commands)
+            {
+                /* Breakpoint with commands does not stop target */
+                breakpoint_commands(bp);
+                breakpoint_hit = 0;
+            }
+            silent = !breakpoint_hit;
+        }
+        if (0 != call_return_pc &&
+            call_return_pc == registers[PC] &&
+            call_sp <= registers[R0])
+        {
+            /* Called function is returned: step is done */
+            call_return_pc = 0;
+            silent = silent && (range_stepping || finishing);
+        }
+        else if (finishing &&
+                 step_hit &&
+                 0 == call_return_pc &&
+                 finish_return &&
+                 finish_sp < registers[R0])
+        {
+            /* Function is returned */
+            finish_sp = registers[R0];
+            if (0 == --finish_levels)
+            {
+                silent = 0;
+            }
+        }
+        if (range_stepping &&
+            0 == call_return_pc &&
+            (range_start > registers[PC] ||
+             range_end <= registers[PC]))
+        {
+            silent = 0;
+        }
+        watch_hit = watchpoint_triggered();
+        if (NULL != watch_hit)
+        {
+            silent = 0;
+        }
+        stepping_over = 0;
+        /* Stub is active for most of the time of step loops, so break request
+           of GDB is received to the ring buffer rather than by stub_rx_handler */
+        while (silent &&
+               rx_available())
+        {
+            if (SIGBREAK == stub_getchar())
+            {
+                silent = 0;
+                signal = TARGET_SIGNAL_INT;
+            }
+        }
+        if (silent)
+        {
+            if ((!range_stepping && !finishing) ||
+                0 != call_return_pc)
+            {
+                resume(0);
+                return;
+            }
+            if (step_instruction())
+            {
+                return;
+            }
+        }
+    }
+    stepping_over = 0;
+    range_stepping = 0;
+    call_return_pc = 0;
+    finishing = 0;
+    finish_levels = 0;
+    watching = 0;
+    stop_reason[0] = '\0';
+    if (NULL != watch_hit)
+    {
+        /* Report the first address of watched area */
+        unsigned int address = (unsigned int)watch_hit->address;
+        int i;
+        strcpy(stop_reason, "watch:");
+        for (i = 0; i < 8; ++i)
+        {
+            stop_reason[i + 6] = hexchars[(address >> (28 - i * 4)) & 0x0F];
+        }
+        strcpy(stop_reason + 14, ";");
+    }
+    else if (breakpoint_hit)
+    {
+        strcpy(stop_reason, "swbreak:;");
     }
 
     /* Report current state */
@@ -1088,8 +2658,9 @@ static void stub_rsp_handler (unsigned int signal)
     for (;;)
     {
         const char *p = trx_buffer;
+        unsigned int packet_length;
         trx_buffer[0] = '\0';
-        get_packet();
+        packet_length = get_packet();
         /*@-loopswitchbreak@*/
         switch (*p++)
         {
@@ -1155,78 +2726,223 @@ static void stub_rsp_handler (unsigned int signal)
                 break;
             }
             length = hex2int(p, NULL);
-            mem2hex(trx_buffer, (const void*)address, length);
-            break;
+            put_packet_hex((const void*)address, length);
+            /* Reply is already sent */
+            continue;
         }
-        case 'M':                                           /* Write memory */
+        case 'x':                                           /* Read memory (binary) */
         {
             unsigned int length;
-            void * address = (void*)hex2int(p, &p);
+            unsigned int address = hex2int(p, &p);
             if (',' != *p++)
             {
                 strcpy(trx_buffer, "E01");
                 break;
             }
-            length = hex2int(p, &p);
-            if (':' != *p++)
+            length = hex2int(p, NULL);
+            put_packet_binary((const void*)address, length);
+            /* Reply is already sent */
+            continue;
+        }
+        case 'M':                                           /* Write memory */
+        case 'X':                                           /* Write memory (binary) */
+        {
+            unsigned int length;
+            void * address;
+            /* Data is already written by get_packet */
+            if (NULL == parse_write_header(p, &address, &length))
             {
                 strcpy(trx_buffer, "E01");
                 break;
             }
-            /* Check if destination area is RAM */
-            if (RAM_END < (void*)((char*)address + length))
+            decode_cache_invalidate(address, length);
+            /* Check if get_packet has accepted destination area */
+            if (!rx_stream_accepted)
             {
                 strcpy(trx_buffer, "E02");
                 break;
             }
-            hex2mem((void*)address, p, length);
+            /* Check if packet checksum is correct */
+            if (!rx_stream_ok)
+            {
+                strcpy(trx_buffer, "E03");
+                break;
+            }
+            /* Check if all data is received.
+               Empty 'X' packet is used by GDB to probe 'X' support */
+            if (rx_stream_written != length)
+            {
+                strcpy(trx_buffer, "E01");
+                break;
+            }
             strcpy(trx_buffer, "OK");
             break;
         }
-        case 'c':                                           /* Continue */
-            /* If 'continue from address' is requested */
-            if ('\0' != *p)
+        case 'C':                                           /* Continue with signal */
+        case 'S':                                           /* Step with signal */
+            /* Signal can not be delivered to bare-metal target, it is ignored */
+            (void)hex2int(p, &p);
+            if (';' == *p)
             {
-                registers[PC] = hex2int(p, NULL);
+                ++p;
             }
-            return;
+            /*@fallthrough@*/
+        case 'c':                                           /* Continue */
         case 's':                                           /* Step */
-        {
-            /* If 'step from address' is requested */
+            /* If 'continue from address' or 'step from address' is requested */
             if ('\0' != *p)
             {
                 registers[PC] = hex2int(p, NULL);
             }
-            if (OPCODE_BRK == *(unsigned char*)registers[PC])
+            range_stepping = 0;
+            if ('c' == trx_buffer[0] ||
+                'C' == trx_buffer[0])
+            {
+                finish_levels = 0;
+                resume(0);
+                return;
+            }
+            if (!step_instruction())
             {
-                ++registers[PC];
                 prepare_state_report(trx_buffer, TARGET_SIGNAL_TRAP);
                 break;
             }
+            return;
+        case 'v':                                           /* Multi-letter packets */
+            if (0 == strcmp(p, "Cont?"))
+            {
+                strcpy(trx_buffer, "vCont;c;C;s;S;t;r");
+            }
+            else if (0 == strncmp(p, "Cont;", strlen("Cont;")))
+            {
+                if (vcont_command(p + strlen("Cont;")))
+                {
+                    return;
+                }
+            }
             else
             {
-                stepping = 1;
-                start_step();
-                return;
+                trx_buffer[0] = '\0';
             }
-        }
+            break;
         case 'q':                                           /* Query */
             if (0 == strncmp(p, "Supported", strlen("Supported")))
             {
-                strcpy(trx_buffer, "PacketSize=200");
+                strcpy(trx_buffer, "PacketSize=1000;binary-upload+;QStartNoAckMode+;swbreak+;ConditionalBreakpoints+;BreakpointCommands+");
             }
             else if (0 == strcmp(p, "Offsets"))
             {
                 strcpy(trx_buffer, "Text=0;Data=0;Bss=0");
             }
+            else if (0 == strncmp(p, "CRC:", strlen("CRC:")))
+            {
+                unsigned int length;
+                unsigned int address;
+                uint32_t crc;
+                int i;
+                p += strlen("CRC:");
+                address = hex2int(p, &p);
+                if (',' != *p++)
+                {
+                    strcpy(trx_buffer, "E01");
+                    break;
+                }
+                length = hex2int(p, NULL);
+                crc = crc32((const void*)address, length, 0xffffffffUL);
+                trx_buffer[0] = 'C';
+                for (i = 0; i < 8; ++i)
+                {
+                    trx_buffer[i + 1] = hexchars[(crc >> (28 - i * 4)) & 0x0F];
+                }
+                trx_buffer[9] = '\0';
+            }
+            else if (0 == strncmp(p, "Search:memory:", strlen("Search:memory:")))
+            {
+                /* Pattern is binary, its escapes are decoded by get_packet */
+                unsigned int length;
+                unsigned int address;
+                int i;
+                p += strlen("Search:memory:");
+                address = hex2int(p, &p);
+                if (';' != *p++)
+                {
+                    strcpy(trx_buffer, "E01");
+                    break;
+                }
+                length = hex2int(p, &p);
+                if (';' != *p++)
+                {
+                    strcpy(trx_buffer, "E01");
+                    break;
+                }
+                if (!memory_search((const void*)address, length, p, packet_length - (unsigned int)(p - trx_buffer), &address))
+                {
+                    strcpy(trx_buffer, "0");
+                    break;
+                }
+                trx_buffer[0] = '1';
+                trx_buffer[1] = ',';
+                for (i = 0; i < 8; ++i)
+                {
+                    trx_buffer[i + 2] = hexchars[(address >> (28 - i * 4)) & 0x0F];
+                }
+                trx_buffer[10] = '\0';
+            }
+#ifdef DEBUG_TIMING
+            else if (0 == strcmp(p, "RxStub.Timing"))
+            {
+                /* Report "ticks,bytes" of the previous packet, tick is 512 PCLK cycles */
+                char *d = trx_buffer;
+                unsigned int v = timing_ticks;
+                mem2hex(d, &v, sizeof v);
+                d += sizeof(v) * 2;
+                *d++ = ',';
+                v = timing_bytes;
+                mem2hex(d, &v, sizeof v);
+            }
+#endif /* DEBUG_TIMING */
+            else if (0 == strncmp(p, "Rcmd,", strlen("Rcmd,")))
+            {
+                monitor_command(p + strlen("Rcmd,"));
+                /* Reply is already sent */
+                continue;
+            }
             else
             {
                 trx_buffer[0] = '\0';
             }
             break;
-        case 'd':                                           /* Toggle debug */
+        case 'Q':                                           /* Set */
+            if (0 == strcmp(p, "StartNoAckMode"))
+            {
+                /* Reply is acknowledged, mode is changed after it */
+                put_packet("OK");
+                no_ack_mode = 1;
+                continue;
+            }
+            trx_buffer[0] = '\0';
+            break;
         case 'z':                                           /* Remove breakpoint */
         case 'Z':                                           /* Set breakpoint */
+            /* Software breakpoints and write watchpoints are supported */
+            if (',' != p[1])
+            {
+                trx_buffer[0] = '\0';
+            }
+            else if ('0' == p[0])
+            {
+                breakpoint_command(p[-1], p + 2);
+            }
+            else if ('2' == p[0])
+            {
+                watchpoint_command(p[-1], p + 2);
+            }
+            else
+            {
+                trx_buffer[0] = '\0';
+            }
+            break;
+        case 'd':                                           /* Toggle debug */
         default:
             trx_buffer[0] = '\0';
             break;
@@ -1243,16 +2959,18 @@ void debug_puts (/*@unused@*/ const char *str)
 
 static void stub_puts (const char *str)
 {
-    unsigned int length = strlen(str);
-    /* Truncate string to match buffer size */
-    if ((length * 2) > (BUFFER_SIZE - 4))
+    size_t length = strlen(str);
+    stub_enter();
+    /* String is encoded while it is transmitted, so it is not truncated */
+    do
     {
-        length = (BUFFER_SIZE - 4) / 2;
+        packet_begin();
+        packet_putchar('O');
+        packet_putmem(str, length, packet_puthex);
+        packet_puthex('\n');
     }
-    trx_buffer[0] = 'O';
-    mem2hex(trx_buffer + 1, str, length);
-    strcat(trx_buffer, "0A");
-    put_packet(trx_buffer);
+    while (!packet_end());
+    stub_leave();
 }
 
 __attribute__((interrupt,naked))
@@ -1277,7 +2995,9 @@ static void stub_rx_handler (void)
         char c = SCI1.RDR;
         if (SIGBREAK == c)
         {
+            stub_enter();
             stub_rsp_handler(TARGET_SIGNAL_INT);
+            stub_leave();
         }
     }
     restore_context_and_exit();
@@ -1298,7 +3018,9 @@ static void stub_erx_handler (void)
     /*@=noeffect@*/
     /* Reset error flags in status register */
     SCI1.SSR.BYTE = 0x84;
+    stub_enter();
     stub_rsp_handler(TARGET_SIGNAL_INT);
+    stub_leave();
     restore_context_and_exit();
 }
 
@@ -1306,69 +3028,467 @@ __attribute__((interrupt,naked))
 static void stub_brk_handler (void)
 {
     save_context();
+    stub_enter();
     stub_rsp_handler(TARGET_SIGNAL_TRAP);
+    stub_leave();
     restore_context_and_exit();
 }
 
+/* DTC transfer information in full-address mode */
+struct dtc_transfer_info
+{
+    uint32_t mode;                      /* MRA (bits 31-24) and MRB (bits 23-16) */
+    const volatile void *sar;
+    volatile void *dar;
+    uint32_t count;                     /* CRA (bits 31-16) and CRB (bits 15-0) */
+};
+
+#define DTC_MRA_MD_NORMAL (0x0U << 6)
+#define DTC_MRA_MD_REPEAT (0x1U << 6)
+#define DTC_MRA_SZ_BYTE   (0x0U << 4)
+#define DTC_MRA_SM_FIXED  (0x0U << 2)
+#define DTC_MRA_SM_INC    (0x2U << 2)
+#define DTC_MRB_DM_FIXED  (0x0U << 2)
+#define DTC_MRB_DM_INC    (0x2U << 2)
+#define DTC_MODE(mra, mrb) (((uint32_t)(mra) << 24) | ((uint32_t)(mrb) << 16))
+/* Repeat mode counter: CRAH holds reload value and CRAL holds current value */
+#define DTC_REPEAT_COUNT(n) ((((uint32_t)(n) & 0xFFU) << 24) | (((uint32_t)(n) & 0xFFU) << 16))
+
+static volatile struct dtc_transfer_info dtc_tx_info;
+static volatile struct dtc_transfer_info dtc_rx_info;
+
+/* DTC vector table must be aligned on 4 KiB boundary.
+   It is never modified, so it is placed in ROM */
+__attribute__((aligned(4096)))
+static volatile struct dtc_transfer_info * const dtc_vectors[256] =
+{
+    [VECT(SCI1, RXI1)] = &dtc_rx_info,
+    [VECT(SCI1, TXI1)] = &dtc_tx_info,
+};
+
+/* Transmitted data is collected in two buffers:
+   DTC moves one of them to SCI1 while the stub fills another one */
+#define TX_CHUNK_SIZE 128
+
+static char         tx_buffers[2][TX_CHUNK_SIZE];
+static unsigned int tx_index = 0;
+static unsigned int tx_fill = 0;
+
+static void tx_wait (void)
+{
+    /* DTC clears DTCE bit when the last byte is moved to TDR */
+    while (0 != DTCE(SCI1, TXI1));
+    /* Wait till the last byte is shifted out */
+    while (0 == SCI1.SSR.BIT.TEND);
+}
+
+static void tx_flush (void)
+{
+    const char *buffer = tx_buffers[tx_index];
+    if (0 == tx_fill)
+    {
+        return;
+    }
+    tx_wait();
+    /* The first byte is written directly,
+       the rest are moved by DTC on TXI1 requests */
+    IR(SCI1, TXI1) = 0;
+    if (1 < tx_fill)
+    {
+        dtc_tx_info.sar = buffer + 1;
+        dtc_tx_info.count = (uint32_t)(tx_fill - 1) << 16;
+        DTCE(SCI1, TXI1) = 1;
+        IEN(SCI1, TXI1) = 1;
+    }
+    SCI1.TDR = buffer[0];
+    tx_index ^= 1;
+    tx_fill = 0;
+}
+
+static void tx_drain (void)
+{
+    tx_flush();
+    tx_wait();
+    /* DTC passes the request to CPU after the last transfer,
+       it must not be accepted when application is resumed */
+    IEN(SCI1, TXI1) = 0;
+}
+
+/* While the stub is active, DTC stores received data to the ring buffer,
+   so bytes are not lost when the stub is busy.
+   While application is running, SCI1 data is handled by stub_rx_handler */
+#define RX_RING_SIZE 256
+
+static char         rx_ring[RX_RING_SIZE];
+static const char * rx_read = rx_ring;
+
+static void rx_start (void)
+{
+    /* Restart repeat transfer from the beginning of the ring */
+    dtc_rx_info.dar = rx_ring;
+    dtc_rx_info.count = DTC_REPEAT_COUNT(RX_RING_SIZE);
+    rx_read = rx_ring;
+    DTCE(SCI1, RXI1) = 1;
+}
+
+static void rx_stop (void)
+{
+    DTCE(SCI1, RXI1) = 0;
+}
+
+static void stub_enter (void)
+{
+    rx_start();
+}
+
+static void stub_leave (void)
+{
+    tx_drain();
+    rx_stop();
+}
+
+static int rx_available (void)
+{
+    /* Reception is stopped on errors, so reset error flags.
+       Lost data is detected by packet checksum */
+    if (0 != (SCI1.SSR.BYTE & 0x38))
+    {
+        SCI1.SSR.BYTE = 0x84;
+        IR(SCI1, ERI1) = 0;
+    }
+    /* DTC writes back destination address after each transfer */
+    return rx_read != (const volatile char*)dtc_rx_info.dar;
+}
+
 static void stub_putchar (char c)
 {
-    while (0 == IR(SCI1,TXI1));
-    IR(SCI1,TXI1) = 0;
-    SCI1.TDR = c;
+    if (TX_CHUNK_SIZE == tx_fill)
+    {
+        tx_flush();
+    }
+    tx_buffers[tx_index][tx_fill++] = c;
 }
 
 static char stub_getchar (void)
 {
     char c;
-    while (0 == IR(SCI1,RXI1));
-    IR(SCI1,RXI1) = 0;
-    c = SCI1.RDR;
+    /* Send pending data before waiting for reply */
+    tx_flush();
+    while (!rx_available());
+    c = *rx_read++;
+    if ((rx_ring + RX_RING_SIZE) == rx_read)
+    {
+        rx_read = rx_ring;
+    }
     return c;
 }
 
+/* Clock configuration: EXTAL frequency and multipliers (1, 2, 4 or 8)
+   that are used to get ICLK, BCLK and PCLK */
+#ifndef EXTAL_FREQUENCY
+#define EXTAL_FREQUENCY 12000000UL
+#endif
+
+#ifndef ICLK_MUL
+#define ICLK_MUL 8
+#endif
+
+#ifndef BCLK_MUL
+#define BCLK_MUL 4
+#endif
+
+#ifndef PCLK_MUL
+#define PCLK_MUL 4
+#endif
+
+#define ICLK_FREQUENCY (EXTAL_FREQUENCY * ICLK_MUL)
+#define BCLK_FREQUENCY (EXTAL_FREQUENCY * BCLK_MUL)
+
 #ifndef PCLK_FREQUENCY
-#define PCLK_FREQUENCY 48000000UL
+#define PCLK_FREQUENCY (EXTAL_FREQUENCY * PCLK_MUL)
+#endif
+
+#if ICLK_FREQUENCY > 100000000UL || BCLK_FREQUENCY > 100000000UL || PCLK_FREQUENCY > 50000000UL
+#error "Clock frequency exceeds maximum allowed value"
+#endif
+
+#if ICLK_FREQUENCY < PCLK_FREQUENCY || ICLK_FREQUENCY < BCLK_FREQUENCY
+#error "ICLK frequency must not be lower than BCLK and PCLK"
 #endif
 
+/* SCKCR divider field value for multiplier */
+#define SCKCR_MUL(mul) ((8 == (mul)) ? 0UL : (4 == (mul)) ? 1UL : (2 == (mul)) ? 2UL : 3UL)
+
+#if (ICLK_MUL != 8 && ICLK_MUL != 4 && ICLK_MUL != 2 && ICLK_MUL != 1) || \
+    (BCLK_MUL != 8 && BCLK_MUL != 4 && BCLK_MUL != 2 && BCLK_MUL != 1) || \
+    (PCLK_MUL != 8 && PCLK_MUL != 4 && PCLK_MUL != 2 && PCLK_MUL != 1)
+#error "Clock multiplier must be 1, 2, 4 or 8"
+#endif
+
+/* BCLK and SDCLK outputs are disabled (fixed high) */
+#define SCKCR_VALUE ((SCKCR_MUL(ICLK_MUL) << 24) |    \
+                     (1UL << 23) | (1UL << 22) |        \
+                     (SCKCR_MUL(BCLK_MUL) << 16) |      \
+                     (SCKCR_MUL(PCLK_MUL) << 8))
+
 #ifndef SCI1_BAUDRATE
 #define SCI1_BAUDRATE  115200U
 #endif
 
+/* Maximum allowed baudrate error in 1/1000 units */
+#ifndef SCI1_BAUDRATE_MAX_ERROR
+#define SCI1_BAUDRATE_MAX_ERROR 25
+#endif
+
+/* Compile-time solver for SCI1 baudrate settings.
+   Bit period is 64 * 2^(2n-1) PCLK cycles, where n is SMR.CKS, and ABCS halves it.
+   Every combination gets a key: error (1/1000 units) * 8 + cks * 2 + abcs,
+   so the lowest key gives the lowest error, ABCS = 0 is preferred on ties */
+#define SCI_DIVIDER(cks, abcs) ((32UL >> (abcs)) << (2 * (cks)))
+#define SCI_N(cks, abcs, baud)                                          \
+    (((baud) > PCLK_FREQUENCY / SCI_DIVIDER(cks, abcs)) ? 0UL :         \
+     (PCLK_FREQUENCY + SCI_DIVIDER(cks, abcs) * (baud) / 2) /           \
+     (SCI_DIVIDER(cks, abcs) * (baud)))
+#define SCI_ACTUAL(cks, abcs, baud)                                     \
+    (PCLK_FREQUENCY / (SCI_DIVIDER(cks, abcs) * SCI_N(cks, abcs, baud)))
+#define SCI_ERROR(cks, abcs, baud)                                      \
+    ((0UL == SCI_N(cks, abcs, baud) || 256UL < SCI_N(cks, abcs, baud)) ? 1000000UL : \
+     ((SCI_ACTUAL(cks, abcs, baud) > (baud)) ?                          \
+      (SCI_ACTUAL(cks, abcs, baud) - (baud)) :                          \
+      ((baud) - SCI_ACTUAL(cks, abcs, baud))) * 1000UL / (baud))
+#define SCI_KEY(cks, abcs, baud) (SCI_ERROR(cks, abcs, baud) * 8UL + (cks) * 2UL + (abcs))
+#define SCI_MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define SCI_KEY_CKS(cks, baud) SCI_MIN(SCI_KEY(cks, 0, baud), SCI_KEY(cks, 1, baud))
+#define SCI_BEST_KEY(baud)                                              \
+    SCI_MIN(SCI_MIN(SCI_KEY_CKS(0, baud), SCI_KEY_CKS(1, baud)),        \
+            SCI_MIN(SCI_KEY_CKS(2, baud), SCI_KEY_CKS(3, baud)))
+
+#if (SCI_BEST_KEY(SCI1_BAUDRATE) / 8) > SCI1_BAUDRATE_MAX_ERROR
+#error "SCI1 baudrate can not be achieved with required accuracy at current PCLK frequency"
+#endif
+
+#if (SCI_BEST_KEY(SCI1_BAUDRATE) % 8) == 0
+#define SCI1_CKS  0
+#define SCI1_ABCS 0
+#elif (SCI_BEST_KEY(SCI1_BAUDRATE) % 8) == 1
+#define SCI1_CKS  0
+#define SCI1_ABCS 1
+#elif (SCI_BEST_KEY(SCI1_BAUDRATE) % 8) == 2
+#define SCI1_CKS  1
+#define SCI1_ABCS 0
+#elif (SCI_BEST_KEY(SCI1_BAUDRATE) % 8) == 3
+#define SCI1_CKS  1
+#define SCI1_ABCS 1
+#elif (SCI_BEST_KEY(SCI1_BAUDRATE) % 8) == 4
+#define SCI1_CKS  2
+#define SCI1_ABCS 0
+#elif (SCI_BEST_KEY(SCI1_BAUDRATE) % 8) == 5
+#define SCI1_CKS  2
+#define SCI1_ABCS 1
+#elif (SCI_BEST_KEY(SCI1_BAUDRATE) % 8) == 6
+#define SCI1_CKS  3
+#define SCI1_ABCS 0
+#else
+#define SCI1_CKS  3
+#define SCI1_ABCS 1
+#endif
+
+#define SCI1_BRR (SCI_N(SCI1_CKS, SCI1_ABCS, SCI1_BAUDRATE) - 1)
+
+/* Time to wait for GDB to reconnect at new baudrate in 100 ms units */
+#define BAUDRATE_SWITCH_TIMEOUT 50
+
+struct sci_baudrate
+{
+    unsigned char cks;                  /* SMR.CKS: PCLK/(4^cks) */
+    unsigned char abcs;                 /* SEMR.ABCS: 8 (1) or 16 (0) base clock cycles per bit */
+    unsigned char brr;
+};
+
+/* Find settings with the lowest error. Returns error in 1/1000 units */
+static unsigned long sci_baudrate_solve (unsigned long baudrate, /*@out@*/ struct sci_baudrate *cfg)
+{
+    unsigned long best_error = ULONG_MAX;
+    unsigned int cks;
+    unsigned int abcs;
+    cfg->cks = 0;
+    cfg->abcs = 1;
+    cfg->brr = 0;
+    for (cks = 0; cks < 4; ++cks)
+    {
+        for (abcs = 0; abcs < 2; ++abcs)
+        {
+            /* Bit period is 64 * 2^(2n-1) PCLK cycles, it is halved by ABCS */
+            unsigned long divider = (32UL >> abcs) << (2 * cks);
+            unsigned long n;
+            unsigned long actual;
+            unsigned long error;
+            if (baudrate > PCLK_FREQUENCY / divider)
+            {
+                continue;
+            }
+            /* n = BRR + 1, rounded to nearest */
+            n = (PCLK_FREQUENCY + divider * baudrate / 2) / (divider * baudrate);
+            if (0 == n ||
+                256 < n)
+            {
+                continue;
+            }
+            actual = PCLK_FREQUENCY / (divider * n);
+            error = (actual > baudrate) ? (actual - baudrate) : (baudrate - actual);
+            error = error * 1000 / baudrate;
+            if (error < best_error)
+            {
+                best_error = error;
+                cfg->cks = cks;
+                cfg->abcs = abcs;
+                cfg->brr = n - 1;
+            }
+        }
+    }
+    return best_error;
+}
+
+static void sci1_configure (const struct sci_baudrate *cfg)
+{
+    /* Baudrate can be changed only when receiver and transmitter are disabled */
+    SCI1.SCR.BYTE &= ~0x30;
+    SCI1.SMR.BIT.CKS = cfg->cks;
+    SCI1.SEMR.BIT.ABCS = cfg->abcs;
+    SCI1.BRR = cfg->brr;
+    /* Wait at least one bit interval */
+    {
+        int i;
+        for (i = 20000ul; i > 0; --i)
+        {
+            __asm__ __volatile__ ("");
+        }
+    }
+    /* Enable receiver and transmitter. This MUST be done simultaneously. */
+    SCI1.SCR.BYTE |= 0x30;
+}
+
+static int baudrate_handshake (void)
+{
+    int connected = 0;
+    unsigned int ticks = 0;
+    /* CMT1 compare match flag is set every 100 ms */
+    MSTP(CMT1) = 0;
+    CMT.CMSTR0.BIT.STR1 = 0;
+    CMT1.CMCR.WORD = 0x0043;                                /* PCLK/512, compare match request, CPU interrupt is disabled */
+    CMT1.CMCOR = PCLK_FREQUENCY / 512 / 10 - 1;
+    CMT1.CMCNT = 0;
+    IEN(CMT1, CMI1) = 0;
+    IR(CMT1, CMI1) = 0;
+    CMT.CMSTR0.BIT.STR1 = 1;
+    /* GDB sends acknowledge when it connects, anything else is
+       a garbage received at wrong baudrate */
+    while (BAUDRATE_SWITCH_TIMEOUT > ticks)
+    {
+        if (rx_available() &&
+            '+' == stub_getchar())
+        {
+            connected = 1;
+            break;
+        }
+        if (0 != IR(CMT1, CMI1))
+        {
+            IR(CMT1, CMI1) = 0;
+            ++ticks;
+        }
+    }
+    CMT.CMSTR0.BIT.STR1 = 0;
+    IR(CMT1, CMI1) = 0;
+    return connected;
+}
+
+/* Switch SCI1 to new baudrate. Reply to GDB is sent at old baudrate,
+   then GDB must reconnect at new one. If it does not happen,
+   old baudrate is restored */
+static int set_baudrate (unsigned long baudrate)
+{
+    struct sci_baudrate cfg;
+    struct sci_baudrate old;
+    if (SCI1_BAUDRATE_MAX_ERROR < sci_baudrate_solve(baudrate, &cfg))
+    {
+        return -1;
+    }
+    old.cks = SCI1.SMR.BIT.CKS;
+    old.abcs = SCI1.SEMR.BIT.ABCS;
+    old.brr = SCI1.BRR;
+    put_packet("OK");
+    tx_drain();
+    sci1_configure(&cfg);
+    if (baudrate_handshake())
+    {
+        /* It is a new session */
+        no_ack_mode = 0;
+    }
+    else
+    {
+        sci1_configure(&old);
+    }
+    return 0;
+}
+
 __attribute__((constructor(101)))
 void stub_init (void)
 {
-    /* Configure system clocks as following:
+    /* Configure system clocks, by default:
        EXTAL = 12 MHz
        ICLK = 8 * EXTAL = 96 MHz
        BCLK = 4 * EXTAL = 48 MHz
        PCLK = 4 * EXTAL = 48 MHz
        BCLK and SDCLK outputs are disabled (fixed high)
     */
-    SYSTEM.SCKCR.LONG = 0x00C10100UL;
+    SYSTEM.SCKCR.LONG = SCKCR_VALUE;
 
-    _vectors[0] = stub_brk_handler;
-    _vectors[1] = stub_puts_handler;
+    _vectors[VECTOR_BRK] = stub_brk_handler;
+    _vectors[VECTOR_PUTS] = stub_puts_handler;
     _vectors[VECT(SCI1, RXI1)] = stub_rx_handler;
     _vectors[VECT(SCI1, ERI1)] = stub_erx_handler;
 
+    /* Configure DTC, it is used to transmit and receive SCI1 data */
+    MSTP(DTC) = 0;                                          /* Enable module */
+    DTC.DTCADMOD.BIT.SHORT = 0;                             /* Full-address mode */
+    DTC.DTCCR.BIT.RRS = 0;                                  /* Always read transfer information, it is changed by stub */
+    DTC.DTCVBR = (void*)(unsigned int)dtc_vectors;
+    dtc_tx_info.mode = DTC_MODE(DTC_MRA_MD_NORMAL | DTC_MRA_SZ_BYTE | DTC_MRA_SM_INC,
+                                DTC_MRB_DM_FIXED);
+    dtc_tx_info.dar = &SCI1.TDR;
+    dtc_rx_info.mode = DTC_MODE(DTC_MRA_MD_REPEAT | DTC_MRA_SZ_BYTE | DTC_MRA_SM_FIXED,
+                                DTC_MRB_DM_INC);            /* Destination is repeat area */
+    dtc_rx_info.sar = &SCI1.RDR;
+    DTC.DTCST.BIT.DTCST = 1;
+
+#ifdef DEBUG_TIMING
+    /* CMT0 is a free running counter for transmission time measurements */
+    MSTP(CMT0) = 0;
+    CMT0.CMCR.WORD = 0x0003;                                /* PCLK/512, no interrupt */
+    CMT0.CMCOR = 0xFFFF;
+    CMT.CMSTR0.BIT.STR0 = 1;
+#endif /* DEBUG_TIMING */
+
     /* Configure SCI1 */
     MSTP(SCI1) = 0;                                         /* Enable module */
     SCI1.SCR.BYTE = 0;                                      /* Reset module */
     /* Setup RXD1 pin */
     PORT3.DDR.BIT.B0 = 0;
     PORT3.ICR.BIT.B0 = 1;
-    /* Setup TXD1 pin */
+    /* Setup TXD1 pin, keep line idle while transmitter is disabled */
+    PORT2.DR.BIT.B6 = 1;
     PORT2.DDR.BIT.B6 = 1;
 
     SCI1.SCR.BIT.CKE = 0;                                   /* Use internal baudrate generator, SCK pin functions as IO port */
-    SCI1.SMR.BYTE = 0;                                      /* PCLK/1, 8N1, asynchronous mode, multiprocessor mode is disabled */
+    SCI1.SMR.BYTE = 0;                                      /* 8N1, asynchronous mode, multiprocessor mode is disabled */
+    SCI1.SMR.BIT.CKS = SCI1_CKS;                            /* PCLK/(4^CKS) */
     SCI1.SCMR.BIT.SMIF = 0;                                 /* Not smart card mode */
     SCI1.SCMR.BIT.SINV = 0;                                 /* No TDR inversion */
     SCI1.SCMR.BIT.SDIR = 0;                                 /* LSB first */
     SCI1.SEMR.BIT.ACS0 = 0;                                 /* Use external clock */
-    SCI1.SEMR.BIT.ABCS = 1;                                 /* 8 base clock cycles for 1 bit period */
+    SCI1.SEMR.BIT.ABCS = SCI1_ABCS;                         /* 8 (1) or 16 (0) base clock cycles for 1 bit period */
     /* Set baudrate */
-    SCI1.BRR = PCLK_FREQUENCY / (16 * SCI1_BAUDRATE) - 1;
+    SCI1.BRR = SCI1_BRR;
     /* Reset interrupt flags */
     IR(SCI1, RXI1) = 0;
     IR(SCI1, TXI1) = 0;
@@ -0,0 +1,191 @@
+# Generate instruction classification tables for get_next_pc() from
+# rx-opcodes.txt:
+#
+#   awk -f rx-opcodes.awk rx-opcodes.txt > rx-opcodes.h
+#
+# Every first byte gets an entry in insn_table[].  First bytes that are
+# only listed together with a second byte get a table of their own that is
+# indexed by the second byte, so all fields of the length are known when
+# the table is generated.  The only field left for run time is li1h of
+# the MOV #imm instructions, marked with RULE_LI_B1.
+
+BEGIN {
+    FS = "\t"
+    count = 0
+}
+
+/^#/ || NF < 5 {
+    next
+}
+
+{
+    split($1, bytes, " ")
+    pattern0[count] = bytes[1]
+    pattern1[count] = (2 in bytes) ? bytes[2] : ""
+    mnemonic[count] = $3
+    decode[count] = $4
+    flow[count] = $5
+    ++count
+}
+
+function bits(value, high, low)
+{
+    return int(value / 2 ^ low) % (2 ^ (high - low + 1))
+}
+
+function matches(pattern, value,    i, c)
+{
+    for (i = 0; i < 8; ++i)
+    {
+        c = substr(pattern, i + 1, 1)
+        if (c != "x" && c + 0 != bits(value, 7 - i, 7 - i))
+        {
+            return 0
+        }
+    }
+    return 1
+}
+
+# Length of the instruction, byte1 < 0 if the second byte is not known
+function length_of(line, byte0, byte1,    terms, n, i, t, v, sum)
+{
+    n = split(decode[line], terms, "+")
+    sum = 0
+    runtime = 0
+    for (i = 1; i <= n; ++i)
+    {
+        t = terms[i]
+        if (t ~ /^[0-9]+$/)
+        {
+            v = t + 0
+        }
+        else if (t == "ld0")
+        {
+            v = bits(byte0, 1, 0)
+            v = (3 == v) ? 0 : v
+        }
+        else if (t == "ld0r")
+        {
+            v = bits(byte0, 1, 0)
+        }
+        else if (t == "ldd0")
+        {
+            v = bits(byte0, 3, 2)
+            v = (3 == v) ? 0 : v
+        }
+        else if (t == "li0")
+        {
+            v = bits(byte0, 1, 0)
+            v = (0 == v) ? 4 : v
+        }
+        else if (t == "li1h" && byte1 < 0)
+        {
+            runtime = 1
+            v = 0
+        }
+        else if (byte1 < 0)
+        {
+            printf "rx-opcodes.txt: %s needs the second byte\n", mnemonic[line] > "/dev/stderr"
+            exit 1
+        }
+        else if (t == "ld1")
+        {
+            v = bits(byte1, 1, 0)
+            v = (3 == v) ? 0 : v
+        }
+        else if (t == "ex1")
+        {
+            v = bits(byte1, 5, 5)
+        }
+        else if (t == "li1h")
+        {
+            v = bits(byte1, 3, 2)
+            v = (0 == v) ? 4 : v
+        }
+        else
+        {
+            printf "rx-opcodes.txt: unknown field %s of %s\n", t, mnemonic[line] > "/dev/stderr"
+            exit 1
+        }
+        sum += v
+    }
+    return sum
+}
+
+function entry(len, rule, kind, byte, name)
+{
+    printf "    { %d, %-12s %s }, /* %02X %s */\n", len, rule ",", "INSN_" toupper(kind), byte, name
+}
+
+END {
+    print "/* Generated from rx-opcodes.txt by rx-opcodes.awk, do not edit */"
+    prefixes = 0
+    for (b0 = 0; b0 < 256; ++b0)
+    {
+        first[b0] = -1
+        for (line = 0; line < count; ++line)
+        {
+            if (matches(pattern0[line], b0))
+            {
+                first[b0] = line
+                break
+            }
+        }
+        if (first[b0] < 0 || "" == pattern1[first[b0]])
+        {
+            continue
+        }
+        prefix[b0] = prefixes++
+        name = sprintf("insn_table_%02x", b0)
+        prefix_name[prefix[b0]] = name
+        printf "\nstatic const struct insn_class %s[256] =\n{\n", name
+        for (b1 = 0; b1 < 256; ++b1)
+        {
+            found = -1
+            for (line = first[b0]; line < count; ++line)
+            {
+                if (matches(pattern0[line], b0) && "" != pattern1[line] && matches(pattern1[line], b1))
+                {
+                    found = line
+                    break
+                }
+            }
+            if (found < 0)
+            {
+                entry(0, "RULE_FIXED", "undefined", b1, "undefined")
+            }
+            else
+            {
+                entry(length_of(found, b0, b1), "RULE_FIXED", flow[found], b1, mnemonic[found])
+            }
+        }
+        print "};"
+    }
+
+    print "\nstatic const struct insn_class * const insn_prefix_tables[] =\n{"
+    for (i = 0; i < prefixes; ++i)
+    {
+        printf "    %s,\n", prefix_name[i]
+    }
+    print "};"
+
+    print "\nstatic const struct insn_class insn_table[256] =\n{"
+    for (b0 = 0; b0 < 256; ++b0)
+    {
+        line = first[b0]
+        if (line < 0)
+        {
+            entry(0, "RULE_FIXED", "undefined", b0, "undefined")
+        }
+        else if (b0 in prefix)
+        {
+            entry(prefix[b0], "RULE_PREFIX", "next", b0, "prefix")
+        }
+        else
+        {
+            len = length_of(line, b0, -1)
+            entry(len, runtime ? "RULE_LI_B1" : "RULE_FIXED", flow[line], b0, mnemonic[line])
+        }
+    }
+    print "};"
+}